@@ -6,7 +6,10 @@
 #define OP_CODE__H
 
 #include <stdint.h>
+#include <cstring>
+#include <initializer_list>
 #include <string>
+#include <vector>
 
 #include "../vm/eva_value.h"
 
@@ -35,6 +38,7 @@
 
 /**
  * Control flow: jump if the value on stack is false
+ * (address, branch index counting the outcomes)
  */
 #define OP_JMP_IF_ELSE 0x07
 
@@ -53,6 +57,91 @@
  */
 #define OP_SET_GLOBAL 0x10
 
+/**
+ * Creates a map from <count> key/value pairs on the stack
+ */
+#define OP_MAP_NEW 0x11
+
+/**
+ * Map access: get, set, has, delete
+ */
+#define OP_MAP_GET 0x12
+#define OP_MAP_SET 0x13
+#define OP_MAP_HAS 0x14
+#define OP_MAP_DELETE 0x15
+
+/**
+ * Discards the value on top of the stack
+ */
+#define OP_POP 0x16
+
+/**
+ * Fibers: spawn (body follows, operand is the address after it),
+ * yield, join, and end of a fiber body
+ */
+#define OP_SPAWN 0x17
+#define OP_YIELD 0x18
+#define OP_JOIN 0x19
+#define OP_FIBER_END 0x1A
+
+/**
+ * Pushes a parameter of a callable (pmap/preduce body)
+ */
+#define OP_GET_LOCAL 0x1B
+
+/**
+ * Parallel builtins: map and reduce a callable over an input
+ */
+#define OP_PMAP 0x1C
+#define OP_PREDUCE 0x1D
+
+/**
+ * Loops: backward jump counting the back-edge (address, loop index),
+ * and fused counted-loop step (global, body address, loop index)
+ */
+#define OP_LOOP 0x1E
+#define OP_FOR_STEP 0x1F
+
+/**
+ * Creates an instance with room for <count> properties
+ */
+#define OP_NEW_INSTANCE 0x20
+
+/**
+ * Property access through the inline cache <cache>: get, set (pushes
+ * the value), and init (of an instance literal, keeps the instance)
+ */
+#define OP_GET_PROP 0x21
+#define OP_SET_PROP 0x22
+#define OP_INIT_PROP 0x23
+
+/**
+ * Control flow: jump if the value on stack is true (address, branch
+ * index), for branches laid out with the alternate as fall-through
+ */
+#define OP_JMP_IF_TRUE 0x24
+
+/**
+ * String builtin <builtin> (see eva_string.h) on its stack arguments
+ */
+#define OP_STRING 0x25
+
+/**
+ * Prints <count> values from the stack as a line (see eva_output.h)
+ */
+#define OP_PRINT 0x26
+
+/**
+ * Pushes a const with a short index (constant pools over 256 entries)
+ */
+#define OP_CONST_WIDE 0x27
+
+/**
+ * Global access with a short index (over 256 globals)
+ */
+#define OP_GET_GLOBAL_WIDE 0x28
+#define OP_SET_GLOBAL_WIDE 0x29
+
 // -------------------------------------------------------
 
 #define OP_STR(op)                                                             \
@@ -72,6 +161,31 @@ std::string opcodeToString(uint8_t opcode) {
     OP_STR(JMP);
     OP_STR(GET_GLOBAL);
     OP_STR(SET_GLOBAL);
+    OP_STR(MAP_NEW);
+    OP_STR(MAP_GET);
+    OP_STR(MAP_SET);
+    OP_STR(MAP_HAS);
+    OP_STR(MAP_DELETE);
+    OP_STR(POP);
+    OP_STR(SPAWN);
+    OP_STR(YIELD);
+    OP_STR(JOIN);
+    OP_STR(FIBER_END);
+    OP_STR(GET_LOCAL);
+    OP_STR(PMAP);
+    OP_STR(PREDUCE);
+    OP_STR(LOOP);
+    OP_STR(FOR_STEP);
+    OP_STR(NEW_INSTANCE);
+    OP_STR(GET_PROP);
+    OP_STR(SET_PROP);
+    OP_STR(INIT_PROP);
+    OP_STR(JMP_IF_TRUE);
+    OP_STR(STRING);
+    OP_STR(PRINT);
+    OP_STR(CONST_WIDE);
+    OP_STR(GET_GLOBAL_WIDE);
+    OP_STR(SET_GLOBAL_WIDE);
   default:
     DIE << "opcodeToString: unknown opcode: " << (int)opcode;
   }
@@ -79,4 +193,187 @@ std::string opcodeToString(uint8_t opcode) {
   return "Unknown";
 }
 
+// -------------------------------------------------------
+// Instruction encoding
+
+/**
+ * Byte code (default): an opcode byte followed by its operands
+ * (big-endian). A first operand is 1 or 2 bytes, or 4 bytes for an
+ * address; operands after the first (of conditional jumps, loops) are
+ * 4 bytes. Addresses are byte offsets.
+ *
+ * Wide code (-DEVA_WIDE_CODE): every instruction is an aligned 32-bit
+ * word, the opcode in bits 0-7 and the first operand in bits 8-31.
+ * Operands after the first (of conditional jumps, loops) follow as whole
+ * 32-bit words. Decoding is one aligned load, and addresses are
+ * instruction word indices.
+ */
+#ifdef EVA_WIDE_CODE
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Wide code is decoded with native loads, requires little-endian"
+#endif
+#define CODE_UNIT 4
+#else
+#define CODE_UNIT 1
+#endif
+
+/**
+ * Number of operands of an instruction
+ */
+size_t operandsCount(uint8_t opcode) {
+  switch (opcode) {
+  case OP_CONST:
+  case OP_CONST_WIDE:
+  case OP_COMPARE:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_GLOBAL_WIDE:
+  case OP_SET_GLOBAL_WIDE:
+  case OP_MAP_NEW:
+  case OP_GET_LOCAL:
+  case OP_JMP:
+  case OP_SPAWN:
+  case OP_NEW_INSTANCE:
+  case OP_GET_PROP:
+  case OP_SET_PROP:
+  case OP_INIT_PROP:
+  case OP_STRING:
+  case OP_PRINT:
+    return 1;
+  case OP_JMP_IF_ELSE:
+  case OP_JMP_IF_TRUE:
+  case OP_LOOP:
+    return 2;
+  case OP_FOR_STEP:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Width in bytes of operand i
+ */
+size_t operandWidth(uint8_t opcode, size_t i) {
+#ifdef EVA_WIDE_CODE
+  return i == 0 ? 3 : 4;
+#else
+  if (i > 0) {
+    return 4;
+  }
+  switch (opcode) {
+  case OP_JMP_IF_ELSE:
+  case OP_JMP_IF_TRUE:
+  case OP_JMP:
+  case OP_SPAWN:
+  case OP_LOOP:
+    return 4;
+  case OP_CONST_WIDE:
+  case OP_GET_GLOBAL_WIDE:
+  case OP_SET_GLOBAL_WIDE:
+  case OP_FOR_STEP:
+  case OP_GET_PROP:
+  case OP_SET_PROP:
+  case OP_INIT_PROP:
+    return 2;
+  default:
+    return 1;
+  }
+#endif
+}
+
+/**
+ * Byte offset of operand i from the opcode
+ */
+size_t operandOffset(uint8_t opcode, size_t i) {
+#ifdef EVA_WIDE_CODE
+  return i == 0 ? 1 : i * CODE_UNIT;
+#else
+  size_t offset = 1;
+  for (size_t j = 0; j < i; j++) {
+    offset += operandWidth(opcode, j);
+  }
+  return offset;
+#endif
+}
+
+/**
+ * Instruction size in bytes (opcode + operands)
+ */
+size_t opcodeSize(uint8_t opcode) {
+  auto count = operandsCount(opcode);
+#ifdef EVA_WIDE_CODE
+  return CODE_UNIT * (count == 0 ? 1 : count);
+#else
+  return operandOffset(opcode, count);
+#endif
+}
+
+/**
+ * Reads operand i of the instruction at offset
+ */
+size_t getOperand(const std::vector<uint8_t> &code, size_t offset, size_t i) {
+  auto opcode = code[offset];
+  auto at = offset + operandOffset(opcode, i);
+  auto width = operandWidth(opcode, i);
+
+  size_t value = 0;
+  for (size_t b = 0; b < width; b++) {
+#ifdef EVA_WIDE_CODE
+    value |= (size_t)code[at + b] << (8 * b);
+#else
+    value = (value << 8) | code[at + b];
+#endif
+  }
+  return value;
+}
+
+/**
+ * Writes operand i of the instruction at offset
+ */
+void setOperand(std::vector<uint8_t> &code, size_t offset, size_t i,
+                size_t value) {
+  auto opcode = code[offset];
+  auto at = offset + operandOffset(opcode, i);
+  auto width = operandWidth(opcode, i);
+
+  if (width < sizeof(size_t) && (value >> (8 * width)) != 0) {
+    DIE << "Operand " << value << " of " << opcodeToString(opcode)
+        << " exceeds " << width << "-byte limit";
+  }
+
+  for (size_t b = 0; b < width; b++) {
+#ifdef EVA_WIDE_CODE
+    code[at + b] = (value >> (8 * b)) & 0xFF;
+#else
+    code[at + width - 1 - b] = (value >> (8 * b)) & 0xFF;
+#endif
+  }
+}
+
+/**
+ * Appends an instruction, returns its offset
+ */
+size_t emitInstruction(std::vector<uint8_t> &code, uint8_t opcode,
+                       std::initializer_list<size_t> operands = {}) {
+  auto offset = code.size();
+  code.resize(offset + opcodeSize(opcode));
+  code[offset] = opcode;
+
+  size_t i = 0;
+  for (auto operand : operands) {
+    setOperand(code, offset, i++, operand);
+  }
+  return offset;
+}
+
+/**
+ * Reads an instruction word (wide code)
+ */
+inline uint32_t decodeWord(const uint8_t *ip) {
+  uint32_t word;
+  memcpy(&word, ip, sizeof(word));
+  return word;
+}
+
 #endif
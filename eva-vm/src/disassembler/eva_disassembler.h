@@ -6,6 +6,8 @@
 #define EVA_DISASSEMBLER__H
 
 #include "../bytecode/op_code.h"
+#include "../parser/eva_parser.h"
+#include "../vm/eva_string.h"
 #include "../vm/eva_value.h"
 #include "../vm/global.h"
 
@@ -28,11 +30,23 @@ public:
     std::cout << "\n--------------- Disassembly: " << co->name
               << " ---------------\n\n";
 
+    if (co->lazy != nullptr && co->code.empty()) {
+      std::cout << "(compiled on the first call)\n";
+      return;
+    }
+
     size_t offset = 0;
     while (offset < co->code.size()) {
       offset = disassembleInstruction(co, offset);
       std::cout << "\n";
     }
+
+    // Nested callables (pmap/preduce bodies)
+    for (auto &constant : co->constants) {
+      if (IS_CODE(constant)) {
+        disassemble(AS_CODE(constant));
+      }
+    }
   }
 
 private:
@@ -42,9 +56,9 @@ private:
   size_t disassembleInstruction(CodeObject *co, size_t offset) {
     std::ios_base::fmtflags f(std::cout.flags());
 
-    // Print bytecode offset
+    // Print instruction address (jump targets refer to it)
     std::cout << std::uppercase << std::hex << std::setfill('0') << std::setw(4)
-              << offset << "     ";
+              << offset / CODE_UNIT << "     ";
 
     uint8_t opcode = co->code[offset];
 
@@ -54,16 +68,48 @@ private:
     case OP_SUB:
     case OP_MUL:
     case OP_DIV:
+    case OP_MAP_GET:
+    case OP_MAP_SET:
+    case OP_MAP_HAS:
+    case OP_MAP_DELETE:
+    case OP_POP:
+    case OP_YIELD:
+    case OP_JOIN:
+    case OP_FIBER_END:
+    case OP_PMAP:
+    case OP_PREDUCE:
       return disassembleSimple(co, opcode, offset);
+    case OP_MAP_NEW:
+      return disassembleMapNew(co, opcode, offset);
+    case OP_NEW_INSTANCE:
+      return disassembleInstanceNew(co, opcode, offset);
+    case OP_GET_PROP:
+    case OP_SET_PROP:
+    case OP_INIT_PROP:
+      return disassembleProperty(co, opcode, offset);
+    case OP_GET_LOCAL:
+      return disassembleLocal(co, opcode, offset);
+    case OP_LOOP:
+    case OP_FOR_STEP:
+      return disassembleLoop(co, opcode, offset);
     case OP_CONST:
+    case OP_CONST_WIDE:
       return disassembleConst(co, opcode, offset);
     case OP_COMPARE:
       return disassembleCompare(co, opcode, offset);
+    case OP_STRING:
+      return disassembleString(co, opcode, offset);
+    case OP_PRINT:
+      return disassemblePrint(co, opcode, offset);
     case OP_JMP_IF_ELSE:
+    case OP_JMP_IF_TRUE:
     case OP_JMP:
+    case OP_SPAWN:
       return disassembleJump(co, opcode, offset);
     case OP_GET_GLOBAL:
     case OP_SET_GLOBAL:
+    case OP_GET_GLOBAL_WIDE:
+    case OP_SET_GLOBAL_WIDE:
       return disassembleGlobal(co, opcode, offset);
     default:
       DIE << "disassembleInstruction: no disassembly for "
@@ -79,33 +125,76 @@ private:
    * Disassembles simple instructions
    */
   size_t disassembleSimple(CodeObject *co, uint8_t opcode, size_t offset) {
-    dumpBytes(co, offset, 1);
+    dumpBytes(co, offset, opcodeSize(opcode));
     printOpCode(opcode);
-    return offset + 1;
+    return offset + opcodeSize(opcode);
   }
 
   /**
    * Disassembles const instruction OP_CONST <index>
    */
   size_t disassembleConst(CodeObject *co, uint8_t opcode, size_t offset) {
-    dumpBytes(co, offset, 2);
+    dumpBytes(co, offset, opcodeSize(opcode));
     printOpCode(opcode);
-    auto constIndex = co->code[offset + 1];
+    auto constIndex = getOperand(co->code, offset, 0);
     std::cout << (int)constIndex << " ("
               << evaValueToConstantString(co->constants[constIndex]) << ")";
-    return offset + 2;
+    return offset + opcodeSize(opcode);
   }
 
   /**
    * Disassembles global variable instruction
    */
   size_t disassembleGlobal(CodeObject *co, uint8_t opcode, size_t offset) {
-    dumpBytes(co, offset, 2);
+    dumpBytes(co, offset, opcodeSize(opcode));
     printOpCode(opcode);
-    auto globalIndex = co->code[offset + 1];
+    auto globalIndex = getOperand(co->code, offset, 0);
     std::cout << (int)globalIndex << " (" << global->get(globalIndex).name
               << ")";
-    return offset + 2;
+    return offset + opcodeSize(opcode);
+  }
+
+  /**
+   * Disassembles map creation OP_MAP_NEW <count>
+   */
+  size_t disassembleMapNew(CodeObject *co, uint8_t opcode, size_t offset) {
+    dumpBytes(co, offset, opcodeSize(opcode));
+    printOpCode(opcode);
+    std::cout << getOperand(co->code, offset, 0) << " (pairs)";
+    return offset + opcodeSize(opcode);
+  }
+
+  /**
+   * Disassembles instance creation OP_NEW_INSTANCE <count>
+   */
+  size_t disassembleInstanceNew(CodeObject *co, uint8_t opcode,
+                                size_t offset) {
+    dumpBytes(co, offset, opcodeSize(opcode));
+    printOpCode(opcode);
+    std::cout << getOperand(co->code, offset, 0) << " (properties)";
+    return offset + opcodeSize(opcode);
+  }
+
+  /**
+   * Disassembles property access OP_GET_PROP <cache>, ...
+   */
+  size_t disassembleProperty(CodeObject *co, uint8_t opcode, size_t offset) {
+    dumpBytes(co, offset, opcodeSize(opcode));
+    printOpCode(opcode);
+    auto cacheIndex = getOperand(co->code, offset, 0);
+    std::cout << cacheIndex << " ("
+              << symbolName(co->propertyCaches[cacheIndex].key) << ")";
+    return offset + opcodeSize(opcode);
+  }
+
+  /**
+   * Disassembles parameter access OP_GET_LOCAL <index>
+   */
+  size_t disassembleLocal(CodeObject *co, uint8_t opcode, size_t offset) {
+    dumpBytes(co, offset, opcodeSize(opcode));
+    printOpCode(opcode);
+    std::cout << getOperand(co->code, offset, 0) << " (local)";
+    return offset + opcodeSize(opcode);
   }
 
   /**
@@ -138,11 +227,35 @@ private:
    * Disassembles compare instruction
    */
   size_t disassembleCompare(CodeObject *co, uint8_t opcode, size_t offset) {
-    dumpBytes(co, offset, 2);
+    dumpBytes(co, offset, opcodeSize(opcode));
     printOpCode(opcode);
-    auto compareOp = co->code[offset + 1];
+    auto compareOp = getOperand(co->code, offset, 0);
     std::cout << (int)compareOp << " (" << inverseCompareOps_[compareOp] << ")";
-    return offset + 2;
+    return offset + opcodeSize(opcode);
+  }
+
+  /**
+   * Disassembles string builtin OP_STRING <builtin>
+   */
+  size_t disassembleString(CodeObject *co, uint8_t opcode, size_t offset) {
+    dumpBytes(co, offset, opcodeSize(opcode));
+    printOpCode(opcode);
+    auto builtin = getOperand(co->code, offset, 0);
+    std::cout << builtin << " ("
+              << (builtin < STRING_BUILTINS_COUNT ? stringBuiltinNames[builtin]
+                                                  : "unknown")
+              << ")";
+    return offset + opcodeSize(opcode);
+  }
+
+  /**
+   * Disassembles OP_PRINT <count>
+   */
+  size_t disassemblePrint(CodeObject *co, uint8_t opcode, size_t offset) {
+    dumpBytes(co, offset, opcodeSize(opcode));
+    printOpCode(opcode);
+    std::cout << getOperand(co->code, offset, 0) << " (values)";
+    return offset + opcodeSize(opcode);
   }
 
   /**
@@ -151,23 +264,48 @@ private:
   size_t disassembleJump(CodeObject *co, uint8_t opcode, size_t offset) {
     std::ios_base::fmtflags f(std::cout.flags());
 
-    dumpBytes(co, offset, 3);
+    dumpBytes(co, offset, opcodeSize(opcode));
     printOpCode(opcode);
-    uint16_t address = readWordAtOffset(co, offset + 1);
+    auto address = getOperand(co->code, offset, 0);
 
     std::cout << std::uppercase << std::hex << std::setfill('0') << std::setw(4)
-              << (int)address << " ";
+              << address << " ";
+
+    // Conditional jumps count the outcomes of their branch
+    if (operandsCount(opcode) == 2) {
+      std::cout << std::dec << "(branch " << getOperand(co->code, offset, 1)
+                << ")";
+    }
 
     std::cout.flags(f);
 
-    return offset + 3; // instruction + 2 bytes address
+    return offset + opcodeSize(opcode);
   }
 
   /**
-   * Reads a word at offset
+   * Disassembles loop instructions:
+   * OP_LOOP <address> <loop>, OP_FOR_STEP <global> <address> <loop>
    */
-  uint16_t readWordAtOffset(CodeObject *co, size_t offset) {
-    return (uint16_t((co->code[offset] << 8) | co->code[offset + 1]));
+  size_t disassembleLoop(CodeObject *co, uint8_t opcode, size_t offset) {
+    std::ios_base::fmtflags f(std::cout.flags());
+
+    auto size = opcodeSize(opcode);
+    dumpBytes(co, offset, size);
+    printOpCode(opcode);
+
+    size_t operand = 0;
+    if (opcode == OP_FOR_STEP) {
+      std::cout << global->get(getOperand(co->code, offset, operand++)).name
+                << " ";
+    }
+
+    std::cout << std::uppercase << std::hex << std::setfill('0') << std::setw(4)
+              << getOperand(co->code, offset, operand) << std::dec << " (loop "
+              << getOperand(co->code, offset, operand + 1) << ")";
+
+    std::cout.flags(f);
+
+    return offset + size;
   }
 
   /**
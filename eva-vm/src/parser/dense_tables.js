@@ -0,0 +1,377 @@
+/**
+ * Post-processes the parser generated by syntax-cli:
+ *
+ *   - the LALR table becomes a dense constexpr [state][symbol] array
+ *     (instead of a std::map per row)
+ *   - tokens are value types (instead of heap-allocated SharedToken)
+ *   - productions are referenced instead of copied, values are moved
+ *   - the tokenizer matches in place at the cursor (no string copies)
+ *   - the source and tokens are std::string_view (e.g. a mapped file)
+ *   - syntax errors are thrown by value, without printing
+ *
+ * Usage: node dense_tables.js eva_parser.h
+ */
+
+const fs = require('fs');
+
+const file = process.argv[2];
+let source = fs.readFileSync(file, 'utf8');
+
+/**
+ * Replaces exact text, failing if the generated code changed shape.
+ */
+function replace(from, to) {
+  if (!source.includes(from)) {
+    console.error(`dense_tables.js: pattern not found:\n${from}`);
+    process.exit(1);
+  }
+  source = source.split(from).join(to);
+}
+
+// ------------------------------------------------------------------
+// Parsing table: std::map rows -> dense [state][symbol] array.
+
+const tableMatch = source.match(
+  /\/\/ -+\n\/\/ Parsing table\.\n\n\/\/ clang-format off\nstd::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = \{\n([\s\S]*?)\n\};\n\/\/ clang-format on\n\n/
+);
+
+if (!tableMatch) {
+  console.error('dense_tables.js: parsing table not found');
+  process.exit(1);
+}
+
+const rows = tableMatch[1].split('\n').map(line => {
+  const row = new Map();
+  const entry = /\{(\d+), \{TE::(\w+), (\d+)\}\}/g;
+  let m;
+  while ((m = entry.exec(line)) !== null) {
+    row.set(Number(m[1]), `{TE::${m[2]}, ${m[3]}}`);
+  }
+  return row;
+});
+
+const symbolsCount =
+  Math.max(...rows.map(row => Math.max(-1, ...row.keys()))) + 1;
+
+const denseRows = rows.map((row, state) => {
+  const entries = [];
+  for (let symbol = 0; symbol < symbolsCount; symbol++) {
+    entries.push(row.get(symbol) || '{}');
+  }
+  return `    /* ${state} */ {${entries.join(', ')}}`;
+});
+
+source = source.replace(tableMatch[0], '');
+
+replace(
+  `  static constexpr size_t ROWS_COUNT = ${rows.length};
+  static std::array<Row, ROWS_COUNT> table_;`,
+  `  static constexpr size_t ROWS_COUNT = ${rows.length};
+  static constexpr size_t SYMBOLS_COUNT = ${symbolsCount};
+
+  // Dense parsing table: [state][encoded symbol], {} is an error entry.
+  static constexpr TableEntry table_[ROWS_COUNT][SYMBOLS_COUNT] = {
+${denseRows.join(',\n')}
+  };`
+);
+
+replace(
+  `// Key: Encoded symbol (terminal or non-terminal) index
+// Value: TableEntry
+using Row = std::map<int, TableEntry>;
+
+`,
+  ''
+);
+
+replace(
+  `enum class TE {
+  Accept,`,
+  `enum class TE {
+  Error,
+  Accept,`
+);
+
+// ------------------------------------------------------------------
+// Parsing loop.
+
+replace(
+  `    auto token = tokenizer.getNextToken();
+    auto shiftedToken = token;`,
+  `    auto token = tokenizer.getNextToken();
+    Token shiftedToken = token;`
+);
+
+replace(
+  `      auto column = (int)token->type;
+
+      if (table_[state].count(column) == 0) {
+        throwUnexpectedToken(token);
+      }
+
+      auto entry = table_[state].at(column);`,
+  `      auto column = (int)token.type;
+      const auto& entry = table_[state][column];
+
+      if (entry.type == TE::Error) {
+        throwUnexpectedToken(token);
+      }`
+);
+
+replace(
+  `        tokensStack.push_back(token->value);`,
+  `        tokensStack.push_back(token.value);`
+);
+
+replace(
+  `        shiftedToken = token;
+        token = tokenizer.getNextToken();`,
+  `        shiftedToken = std::move(token);
+        token = tokenizer.getNextToken();`
+);
+
+replace(
+  `        auto production = productions_[productionNumber];
+
+        tokenizer.yytext = shiftedToken->value;`,
+  `        const auto& production = productions_[productionNumber];
+
+        tokenizer.yytext = shiftedToken.value;`
+);
+
+replace(
+  `        auto nextStateEntry = table_[previousState].at(symbolToReduceWith);`,
+  `        const auto& nextStateEntry = table_[previousState][symbolToReduceWith];`
+);
+
+replace(
+  `        auto result = valuesStack.back(); valuesStack.pop_back();`,
+  `        auto result = std::move(valuesStack.back()); valuesStack.pop_back();`
+);
+
+replace(
+  `  [[noreturn]] void throwUnexpectedToken(SharedToken token) {
+    if (token->type == TokenType::__EOF && !tokenizer.hasMoreTokens()) {`,
+  `  [[noreturn]] void throwUnexpectedToken(const Token& token) {
+    if (token.type == TokenType::__EOF && !tokenizer.hasMoreTokens()) {`
+);
+
+replace(
+  `    tokenizer.throwUnexpectedToken(token->value, token->startLine,
+                                   token->startColumn);`,
+  `    tokenizer.throwUnexpectedToken(token.value, token.startLine,
+                                   token.startColumn);`
+);
+
+// ------------------------------------------------------------------
+// Values are moved between the stack and semantic actions.
+
+replace(
+  `#define POP_V()              \\
+  parser.valuesStack.back(); \\
+  parser.valuesStack.pop_back()`,
+  `#define POP_V()                         \\
+  std::move(parser.valuesStack.back()); \\
+  parser.valuesStack.pop_back()`
+);
+
+replace(
+  `#define PUSH_VR() parser.valuesStack.push_back(__)`,
+  `#define PUSH_VR() parser.valuesStack.push_back(std::move(__))`
+);
+
+source = source.replace(/^auto __ = (_\d+);$/gm, 'auto __ = std::move($1);');
+
+// ------------------------------------------------------------------
+// Tokens are values.
+
+replace(
+  `using SharedToken = std::shared_ptr<Token>;
+
+`,
+  ''
+);
+
+replace(`  SharedToken getNextToken() {`, `  Token getNextToken() {`);
+
+replace(
+  `  SharedToken toToken(TokenType tokenType) {
+    return std::shared_ptr<Token>(new Token{`,
+  `  Token toToken(TokenType tokenType) {
+    return Token{`
+);
+
+replace(
+  `        .endColumn = tokenEndColumn_,
+    });
+  }`,
+  `        .endColumn = tokenEndColumn_,
+    };
+  }`
+);
+
+// ------------------------------------------------------------------
+// Tokenizer matches in place at the cursor.
+
+replace(
+  `    auto strSlice = str_.substr(cursor_);
+
+    auto lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
+
+    for (const auto& ruleIndex : lexRulesForState) {
+      auto rule = lexRules_[ruleIndex];
+      std::smatch sm;
+
+      if (std::regex_search(strSlice, sm, rule.regex)) {`,
+  `    const auto& lexRulesForState =
+        lexRulesByStartConditions_.at(getCurrentState());
+
+    for (const auto& ruleIndex : lexRulesForState) {
+      const auto& rule = lexRules_[ruleIndex];
+      std::smatch sm;
+
+      if (std::regex_search(str_.cbegin() + cursor_, str_.cend(), sm,
+                            rule.regex,
+                            std::regex_constants::match_continuous)) {`
+);
+
+replace(
+  `    throwUnexpectedToken(std::string(1, strSlice[0]), currentLine_,`,
+  `    throwUnexpectedToken(std::string(1, str_[cursor_]), currentLine_,`
+);
+
+// ------------------------------------------------------------------
+// Errors are thrown by value, and reported by the caller.
+
+replace(
+  `    std::cerr << errMsg.str();
+    throw new std::runtime_error(errMsg.str().c_str());`,
+  `    throw std::runtime_error(errMsg.str());`
+);
+
+replace(
+  `      std::string errMsg = "Unexpected end of input.\n";
+      std::cerr << errMsg;
+      throw std::runtime_error(errMsg.c_str());`,
+  `      throw std::runtime_error("Unexpected end of input.");`
+);
+
+// ------------------------------------------------------------------
+// Source is a view (e.g. a memory-mapped file), tokens are views
+// into it: nothing is copied until a semantic action builds a value.
+
+replace(`#include <sstream>
+#include <string>
+`, `#include <sstream>
+#include <string>
+#include <string_view>
+`);
+
+replace(
+  `struct Token {
+  TokenType type;
+  std::string value;`,
+  `struct Token {
+  TokenType type;
+  std::string_view value;`
+);
+
+source = source.replace(
+  /const Tokenizer& tokenizer, const std::string& yytext\)/g,
+  'const Tokenizer& tokenizer, std::string_view yytext)'
+);
+
+replace(
+  `typedef TokenType (*LexRuleHandler)(const Tokenizer&, const std::string&);`,
+  `typedef TokenType (*LexRuleHandler)(const Tokenizer&, std::string_view);`
+);
+
+replace(
+  `  void initString(const std::string& str) {`,
+  `  void initString(std::string_view str) {`
+);
+
+replace(
+  `      std::smatch sm;
+
+      if (std::regex_search(str_.cbegin() + cursor_, str_.cend(), sm,
+                            rule.regex,
+                            std::regex_constants::match_continuous)) {
+        yytext = sm[0];`,
+  `      std::cmatch sm;
+
+      if (std::regex_search(str_.data() + cursor_, str_.data() + str_.size(),
+                            sm, rule.regex,
+                            std::regex_constants::match_continuous)) {
+        yytext = std::string_view(sm[0].first, sm[0].length());`
+);
+
+replace(
+  `    throwUnexpectedToken(std::string(1, str_[cursor_]), currentLine_,`,
+  `    throwUnexpectedToken(str_.substr(cursor_, 1), currentLine_,`
+);
+
+replace(
+  `  [[noreturn]] void throwUnexpectedToken(const std::string& symbol, int line,
+                                         int column) {
+    std::stringstream ss{str_};`,
+  `  [[noreturn]] void throwUnexpectedToken(std::string_view symbol, int line,
+                                         int column) {
+    std::stringstream ss{std::string(str_)};`
+);
+
+replace(
+  `  std::string yytext;
+
+ private:`,
+  `  std::string_view yytext;
+
+ private:`
+);
+
+replace(
+  `  void captureLocations_(const std::string& matched) {`,
+  `  void captureLocations_(std::string_view matched) {`
+);
+
+replace(
+  `    // Extract \`\\n\` in the matched token.
+    std::stringstream ss{matched};
+    std::string lineStr;
+    std::getline(ss, lineStr, '\\n');
+    while (ss.tellg() > 0 && ss.tellg() <= len) {
+      currentLine_++;
+      currentLineBeginOffset_ = tokenStartOffset_ + ss.tellg();
+      std::getline(ss, lineStr, '\\n');
+    }`,
+  `    // Extract \`\\n\` in the matched token.
+    for (size_t i = 0; i < len; i++) {
+      if (matched[i] == '\\n') {
+        currentLine_++;
+        currentLineBeginOffset_ = tokenStartOffset_ + i + 1;
+      }
+    }`
+);
+
+replace(
+  `  /**
+   * Tokenizing string.
+   */
+  std::string str_;`,
+  `  /**
+   * Tokenizing string (must outlive the parse).
+   */
+  std::string_view str_;`
+);
+
+replace(
+  `  std::vector<std::string> tokensStack;`,
+  `  std::vector<std::string_view> tokensStack;`
+);
+
+replace(
+  `  Value parse(const std::string& str) {`,
+  `  Value parse(std::string_view str) {`
+);
+
+fs.writeFileSync(file, source);
@@ -28,6 +28,7 @@
 #include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // ------------------------------------
@@ -50,14 +51,63 @@
 //   }
 //
 // clang-format off
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+/**
+ * Symbol ID of non-symbol expressions
+ */
+#define NO_SYMBOL UINT32_MAX
+
+/**
+ * Symbol names and their IDs, shared by all parsers (so it is locked)
+ */
+struct SymbolTable {
+    std::mutex mutex;
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<const std::string*> names;
+};
+
+SymbolTable& symbolTable() {
+    static SymbolTable table;
+    return table;
+}
+
+/**
+ * Interns a symbol name into a dense integer ID, stable for the process
+ */
+uint32_t internSymbol(const std::string& name) {
+    auto& table = symbolTable();
+    std::lock_guard<std::mutex> lock(table.mutex);
+
+    auto [it, inserted] = table.ids.emplace(name, (uint32_t)table.ids.size());
+    if (inserted) {
+        table.names.push_back(&it->first);
+    }
+    return it->second;
+}
+
+/**
+ * Name of an interned symbol
+ */
+std::string symbolName(uint32_t id) {
+    auto& table = symbolTable();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    return *table.names.at(id);
+}
+
 /**
  * Expression type
  */
 enum class ExpType {
     NUMBER,
+    INT,
     STRING,
     SYMBOL,
     LIST
@@ -69,28 +119,53 @@ enum class ExpType {
 struct Exp {
     ExpType type;
 
-    int number;
+    double number;
+    int64_t integer;
     std::string string;
     std::vector<Exp> list;
 
+    // Interned symbol name (see internSymbol):
+    uint32_t symbol = NO_SYMBOL;
+
     // Numbers:
-    Exp(int number) : type(ExpType::NUMBER), number(number) {}
+    Exp(double number) : type(ExpType::NUMBER), number(number) {}
 
-    // Strings, Symbols:
-    Exp(std::string& strVal) {
+    // Integers:
+    Exp(int64_t integer) : type(ExpType::INT), integer(integer) {}
+
+    // Strings, Symbols (from a token, a view of the source):
+    Exp(std::string_view strVal) {
         if (strVal[0] == '"') {
             type = ExpType::STRING;
             string = strVal.substr(1, strVal.size() - 2);
         } else {
             type = ExpType::SYMBOL;
             string = strVal;
+            symbol = internSymbol(string);
         }
     }
 
     // Lists:
-    Exp(std::vector<Exp> list) : type(ExpType::LIST), list(list) {}
+    Exp(std::vector<Exp> list) : type(ExpType::LIST), list(std::move(list)) {}
 };
 
+/**
+ * Numeric literal: integers which fit int64 stay exact, decimals,
+ * exponents and overflowing integers become doubles.
+ */
+Exp parseNumber(std::string_view token) {
+    // strtoll/strtod need a terminated string
+    std::string str(token);
+    if (str.find_first_of(".eE") == std::string::npos) {
+        errno = 0;
+        auto integer = std::strtoll(str.c_str(), nullptr, 10);
+        if (errno != ERANGE) {
+            return Exp((int64_t)integer);
+        }
+    }
+    return Exp(std::strtod(str.c_str(), nullptr));
+}
+
 using Value = Exp;  // clang-format on
 
 namespace syntax {
@@ -130,7 +205,7 @@ enum class TokenType {
 
 struct Token {
   TokenType type;
-  std::string value;
+  std::string_view value;
 
   int startOffset;
   int endOffset;
@@ -140,9 +215,7 @@ struct Token {
   int endColumn;
 };
 
-using SharedToken = std::shared_ptr<Token>;
-
-typedef TokenType (*LexRuleHandler)(const Tokenizer&, const std::string&);
+typedef TokenType (*LexRuleHandler)(const Tokenizer&, std::string_view);
 
 // ------------------------------------------------------------------
 // Lex rule: [regex, handler]
@@ -169,7 +242,7 @@ class Tokenizer {
   /**
    * Initializes a parsing string.
    */
-  void initString(const std::string& str) {
+  void initString(std::string_view str) {
     str_ = str;
 
     // Initialize states.
@@ -221,22 +294,23 @@ class Tokenizer {
   /**
    * Returns next token.
    */
-  SharedToken getNextToken() {
+  Token getNextToken() {
     if (!hasMoreTokens()) {
       yytext = __EOF;
       return toToken(TokenType::__EOF);
     }
 
-    auto strSlice = str_.substr(cursor_);
-
-    auto lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
+    const auto& lexRulesForState =
+        lexRulesByStartConditions_.at(getCurrentState());
 
     for (const auto& ruleIndex : lexRulesForState) {
-      auto rule = lexRules_[ruleIndex];
-      std::smatch sm;
+      const auto& rule = lexRules_[ruleIndex];
+      std::cmatch sm;
 
-      if (std::regex_search(strSlice, sm, rule.regex)) {
-        yytext = sm[0];
+      if (std::regex_search(str_.data() + cursor_, str_.data() + str_.size(),
+                            sm, rule.regex,
+                            std::regex_constants::match_continuous)) {
+        yytext = std::string_view(sm[0].first, sm[0].length());
 
         captureLocations_(yytext);
         cursor_ += yytext.length();
@@ -263,7 +337,7 @@ class Tokenizer {
       return toToken(TokenType::__EOF);
     }
 
-    throwUnexpectedToken(std::string(1, strSlice[0]), currentLine_,
+    throwUnexpectedToken(str_.substr(cursor_, 1), currentLine_,
                          currentColumn_);
   }
 
@@ -272,8 +346,8 @@ class Tokenizer {
    */
   inline bool isEOF() { return cursor_ == str_.length(); }
 
-  SharedToken toToken(TokenType tokenType) {
-    return std::shared_ptr<Token>(new Token{
+  Token toToken(TokenType tokenType) {
+    return Token{
         .type = tokenType,
         .value = yytext,
         .startOffset = tokenStartOffset_,
@@ -282,7 +356,7 @@ class Tokenizer {
         .endLine = tokenEndLine_,
         .startColumn = tokenStartColumn_,
         .endColumn = tokenEndColumn_,
-    });
+    };
   }
 
   /**
@@ -290,9 +364,9 @@ class Tokenizer {
    * line from the source, pointing with the ^ marker to the bad token.
    * In addition, shows `line:column` location.
    */
-  [[noreturn]] void throwUnexpectedToken(const std::string& symbol, int line,
+  [[noreturn]] void throwUnexpectedToken(std::string_view symbol, int line,
                                          int column) {
-    std::stringstream ss{str_};
+    std::stringstream ss{std::string(str_)};
     std::string lineStr;
     int currentLine = 1;
 
@@ -309,20 +383,19 @@ class Tokenizer {
            << pad << "^\nUnexpected token \"" << symbol << "\" at " << line
            << ":" << column << "\n\n";
 
-    std::cerr << errMsg.str();
-    throw new std::runtime_error(errMsg.str().c_str());
+    throw std::runtime_error(errMsg.str());
   }
 
   /**
    * Matched text.
    */
-  std::string yytext;
+  std::string_view yytext;
 
  private:
   /**
    * Captures token locations.
    */
-  void captureLocations_(const std::string& matched) {
+  void captureLocations_(std::string_view matched) {
     auto len = matched.length();
 
     // Absolute offsets.
@@ -333,13 +406,11 @@ class Tokenizer {
     tokenStartColumn_ = tokenStartOffset_ - currentLineBeginOffset_;
 
     // Extract `\n` in the matched token.
-    std::stringstream ss{matched};
-    std::string lineStr;
-    std::getline(ss, lineStr, '\n');
-    while (ss.tellg() > 0 && ss.tellg() <= len) {
-      currentLine_++;
-      currentLineBeginOffset_ = tokenStartOffset_ + ss.tellg();
-      std::getline(ss, lineStr, '\n');
+    for (size_t i = 0; i < len; i++) {
+      if (matched[i] == '\n') {
+        currentLine_++;
+        currentLineBeginOffset_ = tokenStartOffset_ + i + 1;
+      }
     }
 
     tokenEndOffset_ = cursor_ + len;
@@ -365,9 +436,9 @@ class Tokenizer {
   static std::string __EOF;
 
   /**
-   * Tokenizing string.
+   * Tokenizing string (must outlive the parse).
    */
-  std::string str_;
+  std::string_view str_;
 
   /**
    * Cursor for current symbol.
@@ -403,35 +474,35 @@ class Tokenizer {
 std::string Tokenizer::__EOF("$");
 
 // clang-format off
-inline TokenType _lexRule1(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule1(const Tokenizer& tokenizer, std::string_view yytext) {
 return TokenType::TOKEN_TYPE_7;
 }
 
-inline TokenType _lexRule2(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule2(const Tokenizer& tokenizer, std::string_view yytext) {
 return TokenType::TOKEN_TYPE_8;
 }
 
-inline TokenType _lexRule3(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule3(const Tokenizer& tokenizer, std::string_view yytext) {
 return TokenType::__EMPTY;
 }
 
-inline TokenType _lexRule4(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule4(const Tokenizer& tokenizer, std::string_view yytext) {
 return TokenType::__EMPTY;
 }
 
-inline TokenType _lexRule5(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule5(const Tokenizer& tokenizer, std::string_view yytext) {
 return TokenType::__EMPTY;
 }
 
-inline TokenType _lexRule6(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule6(const Tokenizer& tokenizer, std::string_view yytext) {
 return TokenType::STRING;
 }
 
-inline TokenType _lexRule7(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule7(const Tokenizer& tokenizer, std::string_view yytext) {
 return TokenType::NUMBER;
 }
 
-inline TokenType _lexRule8(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule8(const Tokenizer& tokenizer, std::string_view yytext) {
 return TokenType::SYMBOL;
 }
 // clang-format on
@@ -447,7 +518,7 @@ std::array<LexRule, Tokenizer::LEX_RULES_COUNT> Tokenizer::lexRules_ = {{
   {std::regex(R"(^\/\*[\s\S]*?\*\/)"), &_lexRule4},
   {std::regex(R"(^\s+)"), &_lexRule5},
   {std::regex(R"(^"[^\"]*")"), &_lexRule6},
-  {std::regex(R"(^\d+)"), &_lexRule7},
+  {std::regex(R"(^-?\d+(\.\d+)?([eE][+-]?\d+)?)"), &_lexRule7},
   {std::regex(R"(^[\w\-+*=!<>/]+)"), &_lexRule8}
 }};
 std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditions_ =  {{TokenizerState::INITIAL, {0, 1, 2, 3, 4, 5, 6, 7}}};
@@ -456,21 +527,22 @@ std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditio
 #endif
 // clang-format on
 
-#define POP_V()              \
-  parser.valuesStack.back(); \
+#define POP_V()                         \
+  std::move(parser.valuesStack.back()); \
   parser.valuesStack.pop_back()
 
 #define POP_T()              \
   parser.tokensStack.back(); \
   parser.tokensStack.pop_back()
 
-#define PUSH_VR() parser.valuesStack.push_back(__)
+#define PUSH_VR() parser.valuesStack.push_back(std::move(__))
 #define PUSH_TR() parser.tokensStack.push_back(__)
 
 /**
  * Parsing table type.
  */
 enum class TE {
+  Error,
   Accept,
   Shift,
   Reduce,
@@ -505,10 +577,6 @@ struct Production {
   ProductionHandler handler;
 };
 
-// Key: Encoded symbol (terminal or non-terminal) index
-// Value: TableEntry
-using Row = std::map<int, TableEntry>;
-
 /**
  * Parser class.
  */
@@ -524,7 +592,7 @@ class EvaParser {
   /**
    * Token values stack.
    */
-  std::vector<std::string> tokensStack;
+  std::vector<std::string_view> tokensStack;
 
   /**
    * Parsing states stack.
@@ -544,7 +612,7 @@ class EvaParser {
   /**
    * Parses a string.
    */
-  Value parse(const std::string& str) {
+  Value parse(std::string_view str) {
     // clang-format off
     
     // clang-format on
@@ -561,37 +629,36 @@ class EvaParser {
     statesStack.push_back(0);
 
     auto token = tokenizer.getNextToken();
-    auto shiftedToken = token;
+    Token shiftedToken = token;
 
     // Main parsing loop.
     for (;;) {
       auto state = statesStack.back();
-      auto column = (int)token->type;
+      auto column = (int)token.type;
+      const auto& entry = table_[state][column];
 
-      if (table_[state].count(column) == 0) {
+      if (entry.type == TE::Error) {
         throwUnexpectedToken(token);
       }
 
-      auto entry = table_[state].at(column);
-
       // Shift a token, go to state.
       if (entry.type == TE::Shift) {
         // Push token.
-        tokensStack.push_back(token->value);
+        tokensStack.push_back(token.value);
 
         // Push next state number: "s5" -> 5
         statesStack.push_back(entry.value);
 
-        shiftedToken = token;
+        shiftedToken = std::move(token);
         token = tokenizer.getNextToken();
       }
 
       // Reduce by production.
       else if (entry.type == TE::Reduce) {
         auto productionNumber = entry.value;
-        auto production = productions_[productionNumber];
+        const auto& production = productions_[productionNumber];
 
-        tokenizer.yytext = shiftedToken->value;
+        tokenizer.yytext = shiftedToken.value;
 
         auto rhsLength = production.rhsLength;
         while (rhsLength > 0) {
@@ -605,7 +672,7 @@ class EvaParser {
         auto previousState = statesStack.back();
 
         auto symbolToReduceWith = production.opcode;
-        auto nextStateEntry = table_[previousState].at(symbolToReduceWith);
+        const auto& nextStateEntry = table_[previousState][symbolToReduceWith];
         assert(nextStateEntry.type == TE::Transit);
 
         statesStack.push_back(nextStateEntry.value);
@@ -618,7 +685,7 @@ class EvaParser {
 
         // Pop the parsed value.
         // clang-format off
-        auto result = valuesStack.back(); valuesStack.pop_back();
+        auto result = std::move(valuesStack.back()); valuesStack.pop_back();
         // clang-format on
 
         if (statesStack.size() != 1 || statesStack.back() != 0 ||
@@ -641,14 +708,12 @@ class EvaParser {
   /**
    * Throws parser error on unexpected token.
    */
-  [[noreturn]] void throwUnexpectedToken(SharedToken token) {
-    if (token->type == TokenType::__EOF && !tokenizer.hasMoreTokens()) {
-      std::string errMsg = "Unexpected end of input.\n";
-      std::cerr << errMsg;
-      throw std::runtime_error(errMsg.c_str());
+  [[noreturn]] void throwUnexpectedToken(const Token& token) {
+    if (token.type == TokenType::__EOF && !tokenizer.hasMoreTokens()) {
+      throw std::runtime_error("Unexpected end of input.");
     }
-    tokenizer.throwUnexpectedToken(token->value, token->startLine,
-                                   token->startColumn);
+    tokenizer.throwUnexpectedToken(token.value, token.startLine,
+                                   token.startColumn);
   }
 
   // clang-format off
@@ -656,7 +721,22 @@ class EvaParser {
   static std::array<Production, PRODUCTIONS_COUNT> productions_;
 
   static constexpr size_t ROWS_COUNT = 11;
-  static std::array<Row, ROWS_COUNT> table_;
+  static constexpr size_t SYMBOLS_COUNT = 10;
+
+  // Dense parsing table: [state][encoded symbol], {} is an error entry.
+  static constexpr TableEntry table_[ROWS_COUNT][SYMBOLS_COUNT] = {
+    /* 0 */ {{TE::Transit, 1}, {TE::Transit, 2}, {TE::Transit, 3}, {}, {TE::Shift, 4}, {TE::Shift, 5}, {TE::Shift, 6}, {TE::Shift, 7}, {}, {}},
+    /* 1 */ {{}, {}, {}, {}, {}, {}, {}, {}, {}, {TE::Accept, 0}},
+    /* 2 */ {{}, {}, {}, {}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}},
+    /* 3 */ {{}, {}, {}, {}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}},
+    /* 4 */ {{}, {}, {}, {}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}},
+    /* 5 */ {{}, {}, {}, {}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}},
+    /* 6 */ {{}, {}, {}, {}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}},
+    /* 7 */ {{}, {}, {}, {TE::Transit, 8}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {}},
+    /* 8 */ {{TE::Transit, 10}, {TE::Transit, 2}, {TE::Transit, 3}, {}, {TE::Shift, 4}, {TE::Shift, 5}, {TE::Shift, 6}, {TE::Shift, 7}, {TE::Shift, 9}, {}},
+    /* 9 */ {{}, {}, {}, {}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}},
+    /* 10 */ {{}, {}, {}, {}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {}}
+  };
   // clang-format on
 };
 
@@ -668,7 +748,7 @@ void _handler1(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_V();
 
-auto __ = _1;
+auto __ = std::move(_1);
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -679,7 +759,7 @@ void _handler2(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_V();
 
-auto __ = _1;
+auto __ = std::move(_1);
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -690,7 +770,7 @@ void _handler3(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_V();
 
-auto __ = _1;
+auto __ = std::move(_1);
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -701,7 +781,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = parseNumber(_1) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -736,7 +816,7 @@ parser.tokensStack.pop_back();
 auto _2 = POP_V();
 parser.tokensStack.pop_back();
 
-auto __ = _2 ;
+auto __ = std::move(_2) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -759,7 +839,7 @@ void _handler9(yyparse& parser) {
 auto _2 = POP_V();
 auto _1 = POP_V();
 
-_1.list.push_back(_2); auto __ = _1 ;
+_1.list.push_back(std::move(_2)); auto __ = std::move(_1) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -779,25 +859,6 @@ std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1
 {3, 2, &_handler9}}};
 // clang-format on
 
-// ------------------------------------------------------------------
-// Parsing table.
-
-// clang-format off
-std::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = {
-    Row {{0, {TE::Transit, 1}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}},
-    Row {{9, {TE::Accept, 0}}},
-    Row {{4, {TE::Reduce, 1}}, {5, {TE::Reduce, 1}}, {6, {TE::Reduce, 1}}, {7, {TE::Reduce, 1}}, {8, {TE::Reduce, 1}}, {9, {TE::Reduce, 1}}},
-    Row {{4, {TE::Reduce, 2}}, {5, {TE::Reduce, 2}}, {6, {TE::Reduce, 2}}, {7, {TE::Reduce, 2}}, {8, {TE::Reduce, 2}}, {9, {TE::Reduce, 2}}},
-    Row {{4, {TE::Reduce, 3}}, {5, {TE::Reduce, 3}}, {6, {TE::Reduce, 3}}, {7, {TE::Reduce, 3}}, {8, {TE::Reduce, 3}}, {9, {TE::Reduce, 3}}},
-    Row {{4, {TE::Reduce, 4}}, {5, {TE::Reduce, 4}}, {6, {TE::Reduce, 4}}, {7, {TE::Reduce, 4}}, {8, {TE::Reduce, 4}}, {9, {TE::Reduce, 4}}},
-    Row {{4, {TE::Reduce, 5}}, {5, {TE::Reduce, 5}}, {6, {TE::Reduce, 5}}, {7, {TE::Reduce, 5}}, {8, {TE::Reduce, 5}}, {9, {TE::Reduce, 5}}},
-    Row {{3, {TE::Transit, 8}}, {4, {TE::Reduce, 7}}, {5, {TE::Reduce, 7}}, {6, {TE::Reduce, 7}}, {7, {TE::Reduce, 7}}, {8, {TE::Reduce, 7}}},
-    Row {{0, {TE::Transit, 10}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}, {8, {TE::Shift, 9}}},
-    Row {{4, {TE::Reduce, 6}}, {5, {TE::Reduce, 6}}, {6, {TE::Reduce, 6}}, {7, {TE::Reduce, 6}}, {8, {TE::Reduce, 6}}, {9, {TE::Reduce, 6}}},
-    Row {{4, {TE::Reduce, 8}}, {5, {TE::Reduce, 8}}, {6, {TE::Reduce, 8}}, {7, {TE::Reduce, 8}}, {8, {TE::Reduce, 8}}}
-};
-// clang-format on
-
 }  // namespace syntax
 
 #endif
\ No newline at end of file
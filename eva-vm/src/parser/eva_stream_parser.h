@@ -0,0 +1,352 @@
+/**
+ * Eva streaming parser
+ *
+ * Reads source in chunks (from a buffer or a file descriptor), and emits
+ * each top-level form as soon as it's complete. Only the unfinished tail
+ * of the input is buffered. A whole source in memory (e.g. a mapped
+ * file) is parsed in place, without buffering.
+ */
+
+#ifndef EVA_STREAM_PARSER__H
+#define EVA_STREAM_PARSER__H
+
+#include <unistd.h>
+
+#include <cctype>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "../vm/logger.h"
+#include "eva_parser.h"
+
+using syntax::EvaParser;
+
+/**
+ * Default read chunk size
+ */
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+/**
+ * Callback for each complete top-level form
+ */
+using FormHandler = std::function<void(const Exp &)>;
+
+/**
+ * Streaming front end for the parser: splits input into top-level forms
+ * (bracket matching aware of strings and comments), and parses each one.
+ */
+class EvaStreamParser {
+public:
+  EvaStreamParser(EvaParser &parser) : parser(parser) { reset(); }
+
+  /**
+   * Resets the scanner state
+   */
+  void reset() {
+    buffer.clear();
+    input = {};
+    buffered = true;
+    scanPos = 0;
+    formStart = -1;
+    depth = 0;
+    state = ScanState::CODE;
+    line = 1;
+    column = 1;
+    formLine = 1;
+    formColumn = 1;
+  }
+
+  /**
+   * Feeds a chunk, emits complete forms
+   */
+  void feed(const char *data, size_t size, const FormHandler &onForm) {
+    buffer.append(data, size);
+    input = buffer;
+    scan(onForm, false);
+  }
+
+  void feed(const std::string &chunk, const FormHandler &onForm) {
+    feed(chunk.data(), chunk.size(), onForm);
+  }
+
+  /**
+   * End of input: emits a trailing atom, fails on an unfinished form
+   */
+  void finish(const FormHandler &onForm) {
+    input = buffer;
+    scan(onForm, true);
+
+    if (formStart != -1) {
+      syntaxError("Unexpected end of input", formLine, formColumn);
+    }
+
+    reset();
+  }
+
+  /**
+   * Parses a whole source in place: forms are views of the source,
+   * which must outlive the call
+   */
+  void parse(std::string_view source, const FormHandler &onForm) {
+    reset();
+    input = source;
+    buffered = false;
+    scan(onForm, true);
+
+    if (formStart != -1) {
+      syntaxError("Unexpected end of input", formLine, formColumn);
+    }
+
+    reset();
+  }
+
+  /**
+   * Reads and parses the whole file descriptor chunk by chunk
+   */
+  void parseFd(int fd, const FormHandler &onForm,
+               size_t chunkSize = STREAM_CHUNK_SIZE) {
+    std::string chunk(chunkSize, '\0');
+    for (;;) {
+      auto n = read(fd, &chunk[0], chunkSize);
+      if (n < 0) {
+        throw EvaError("EvaStreamParser: read error", EvaErrorKind::SYNTAX);
+      }
+      if (n == 0) {
+        break;
+      }
+      feed(chunk.data(), n, onForm);
+    }
+    finish(onForm);
+  }
+
+  /**
+   * Whether a form is partially read (e.g. REPL continuation)
+   */
+  bool inForm() const { return formStart != -1; }
+
+  /**
+   * Position of the current (or last) top-level form
+   */
+  int getFormLine() const { return formLine; }
+  int getFormColumn() const { return formColumn; }
+
+private:
+  /**
+   * Scanner state, preserved between chunks
+   */
+  enum class ScanState {
+    CODE,
+    ATOM,
+    STRING,
+    LINE_COMMENT,
+    BLOCK_COMMENT,
+  };
+
+  /**
+   * Scans buffered input for complete forms
+   */
+  void scan(const FormHandler &onForm, bool eof) {
+    while (scanPos < input.size()) {
+      auto c = input[scanPos];
+
+      // Need one more char to tell a comment (or its end) apart
+      auto needsLookahead = scanPos + 1 == input.size() && !eof;
+      auto next = scanPos + 1 < input.size() ? input[scanPos + 1] : '\0';
+
+      switch (state) {
+      case ScanState::LINE_COMMENT:
+        if (c == '\n') {
+          state = ScanState::CODE;
+        }
+        break;
+
+      case ScanState::BLOCK_COMMENT:
+        if (c == '*') {
+          if (needsLookahead) {
+            return compact();
+          }
+          if (next == '/') {
+            state = ScanState::CODE;
+            scanPos++;
+          }
+        }
+        break;
+
+      case ScanState::STRING:
+        if (c == '"') {
+          state = ScanState::CODE;
+          if (depth == 0) {
+            emitForm(scanPos + 1, onForm);
+          }
+        }
+        break;
+
+      case ScanState::ATOM:
+        if (isDelimiter(c)) {
+          state = ScanState::CODE;
+          if (depth == 0) {
+            emitForm(scanPos, onForm);
+          }
+          // Re-scan the delimiter as code
+          continue;
+        }
+        break;
+
+      case ScanState::CODE:
+        if (c == '/' && (needsLookahead || next == '/' || next == '*')) {
+          if (needsLookahead) {
+            return compact();
+          }
+          state = next == '/' ? ScanState::LINE_COMMENT
+                              : ScanState::BLOCK_COMMENT;
+          scanPos++;
+        } else if (isspace((unsigned char)c)) {
+          // Skip
+        } else if (c == '(') {
+          startForm();
+          depth++;
+        } else if (c == ')') {
+          if (depth == 0) {
+            syntaxError("Unexpected token \")\"", line, column);
+          }
+          if (--depth == 0) {
+            emitForm(scanPos + 1, onForm);
+          }
+        } else if (c == '"') {
+          startForm();
+          state = ScanState::STRING;
+        } else {
+          startForm();
+          state = ScanState::ATOM;
+        }
+        break;
+      }
+
+      if (input[scanPos] == '\n') {
+        line++;
+        column = 1;
+      } else {
+        column++;
+      }
+      scanPos++;
+    }
+
+    // Trailing top-level atom
+    if (eof && state == ScanState::ATOM && depth == 0) {
+      state = ScanState::CODE;
+      emitForm(scanPos, onForm);
+    }
+
+    compact();
+  }
+
+  /**
+   * Whether the char ends an atom
+   */
+  static bool isDelimiter(char c) {
+    return isspace((unsigned char)c) || c == '(' || c == ')' || c == '"';
+  }
+
+  /**
+   * Marks the start of a top-level form
+   */
+  void startForm() {
+    if (depth == 0) {
+      formStart = scanPos;
+      formLine = line;
+      formColumn = column;
+    }
+  }
+
+  /**
+   * Parses buffered form [formStart, end) and passes it to the handler
+   */
+  void emitForm(size_t end, const FormHandler &onForm) {
+    auto source = input.substr(formStart, end - formStart);
+    formStart = -1;
+    onForm(parseForm(source));
+  }
+
+  /**
+   * Parses a form, syntax errors are reported at the form's position
+   */
+  Exp parseForm(std::string_view source) {
+    try {
+      return parser.parse(source);
+    } catch (const std::runtime_error &error) {
+      syntaxError(error.what(), formLine, formColumn);
+    }
+  }
+
+  /**
+   * Drops consumed input, keeping only the unfinished form
+   */
+  void compact() {
+    if (!buffered) {
+      return;
+    }
+    size_t keepFrom = formStart != -1 ? formStart : scanPos;
+    if (keepFrom == 0) {
+      return;
+    }
+    buffer.erase(0, keepFrom);
+    scanPos -= keepFrom;
+    if (formStart != -1) {
+      formStart = 0;
+    }
+  }
+
+  /**
+   * Reports a syntax error
+   */
+  [[noreturn]] void syntaxError(const std::string &message, int atLine,
+                                int atColumn) {
+    reset();
+    throw EvaError(message, EvaErrorKind::SYNTAX, atLine, atColumn);
+  }
+
+  /**
+   * Parser of individual forms
+   */
+  EvaParser &parser;
+
+  /**
+   * Unconsumed input
+   */
+  std::string buffer;
+
+  /**
+   * Scanned input: the buffer, or a source parsed in place
+   */
+  std::string_view input;
+  bool buffered;
+
+  /**
+   * Scan position in the buffer
+   */
+  size_t scanPos;
+
+  /**
+   * Start of the current top-level form (-1 if none)
+   */
+  int64_t formStart;
+
+  /**
+   * Bracket depth
+   */
+  int depth;
+
+  ScanState state;
+
+  /**
+   * Position tracking for error messages
+   */
+  int line;
+  int column;
+  int formLine;
+  int formColumn;
+};
+
+#endif
@@ -0,0 +1,331 @@
+/**
+ * Eva AOT compiler
+ *
+ * Translates a compiled code object into straight-line C++: one labeled
+ * block per instruction, jumps are gotos, integer and boolean constants
+ * are baked in. Integer fast paths run natively, anything else (strings,
+ * doubles, overflow, maps, instances, builtins) is delegated to
+ * the interpreter instruction by instruction, so results match eval().
+ *
+ * The source is compiled with the system compiler into a shared object,
+ * which the VM loads with dlopen (see EvaVM::compileAot). A shared
+ * object is valid for the code object (constants, global indices) it
+ * was translated from. Fibers are not supported in native code.
+ */
+
+#ifndef EVA_AOT__H
+#define EVA_AOT__H
+
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../bytecode/op_code.h"
+#include "eva_aot_abi.h"
+#include "eva_value.h"
+#include "logger.h"
+
+/**
+ * Environment of the process, passed to the compiler
+ */
+extern char **environ;
+
+/**
+ * Include root of the generated source (the src directory)
+ */
+#ifndef EVA_SOURCE_DIR
+#define EVA_SOURCE_DIR "."
+#endif
+
+/**
+ * Loaded native program
+ */
+struct AotProgram {
+  /**
+   * Code object the program was translated from
+   */
+  CodeObject *co = nullptr;
+
+  std::shared_ptr<void> handle;
+  EvaAotEntry entry = nullptr;
+};
+
+class EvaAot {
+public:
+  /**
+   * Translates a code object into C++ source (with the back-edge,
+   * branch and jump counters, or without)
+   */
+  std::string translate(CodeObject *co, bool counters = true) {
+    auto &code = co->code;
+
+    std::set<size_t> addresses;
+    for (size_t offset = 0; offset < code.size();
+         offset += opcodeSize(code[offset])) {
+      addresses.insert(offset / CODE_UNIT);
+    }
+
+    std::ostringstream out;
+    out << "// Generated by the Eva AOT compiler from " << co->name << "\n\n"
+        << "#include \"vm/eva_aot_abi.h\"\n\n"
+        << "extern \"C\" EvaValue " << EVA_AOT_ENTRY
+        << "(EvaAotContext *ctx) {\n"
+        << "  auto sp = ctx->sp;\n"
+        << "  auto n = ctx->instructions;\n"
+        << "  auto k = ctx->constants;\n"
+        << "  auto g = ctx->globals;\n"
+        << "  auto loops = ctx->loopCounters;\n"
+        << "  (void)k;\n  (void)g;\n  (void)loops;\n\n";
+
+    for (size_t offset = 0; offset < code.size();
+         offset += opcodeSize(code[offset])) {
+      auto opcode = code[offset];
+      auto address = offset / CODE_UNIT;
+
+      // Jump targets must be instructions
+      auto target = [&](size_t i) {
+        auto to = getOperand(code, offset, i);
+        if (addresses.count(to) == 0) {
+          DIE << "[EvaAot]: bad jump target " << to << " in " << co->name;
+        }
+        return "L" + std::to_string(to);
+      };
+
+      out << "L" << address << ": // " << opcodeToString(opcode) << "\n  ";
+
+      switch (opcode) {
+      case OP_HALT:
+        out << "{\n    n++;\n    auto result = AOT_POP();\n"
+            << "    ctx->sp = sp;\n    ctx->instructions = n;\n"
+            << "    return result;\n  }";
+        break;
+
+      case OP_CONST:
+      case OP_CONST_WIDE:
+        out << "n++;\n  AOT_PUSH("
+            << constant(co, getOperand(code, offset, 0)) << ");";
+        break;
+
+      case OP_ADD:
+        out << "AOT_INT_OP(__builtin_add_overflow, " << address << ");";
+        break;
+
+      case OP_SUB:
+        out << "AOT_INT_OP(__builtin_sub_overflow, " << address << ");";
+        break;
+
+      case OP_MUL:
+        out << "AOT_INT_OP(__builtin_mul_overflow, " << address << ");";
+        break;
+
+      case OP_COMPARE: {
+        auto op = getOperand(code, offset, 0);
+        if (op >= sizeof(compareOps_) / sizeof(compareOps_[0])) {
+          DIE << "[EvaAot]: bad compare op " << op;
+        }
+        out << "AOT_INT_COMPARE(" << compareOps_[op] << ", " << address
+            << ");";
+      } break;
+
+      case OP_JMP_IF_ELSE:
+      case OP_JMP_IF_TRUE:
+        out << "{\n    n++;\n    bool cond = AS_BOOLEAN(AOT_POP());\n";
+        if (counters) {
+          out << "    ctx->branchCounters[" << 2 * getOperand(code, offset, 1)
+              << " + cond]++;\n";
+        }
+        out << "    if (" << (opcode == OP_JMP_IF_TRUE ? "cond" : "!cond")
+            << ") {\n" << (counters ? "      ctx->jumps++;\n" : "")
+            << "      goto " << target(0) << ";\n    }\n  }";
+        break;
+
+      case OP_JMP:
+        out << "n++;\n  " << (counters ? "ctx->jumps++;\n  " : "") << "goto "
+            << target(0) << ";";
+        break;
+
+      case OP_GET_GLOBAL:
+      case OP_GET_GLOBAL_WIDE:
+        out << "n++;\n  AOT_PUSH(*g[" << getOperand(code, offset, 0) << "]);";
+        break;
+
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_WIDE:
+        out << "n++;\n  *g[" << getOperand(code, offset, 0) << "] = sp[-1];";
+        break;
+
+      case OP_POP:
+        out << "n++;\n  (void)AOT_POP();";
+        break;
+
+      case OP_GET_LOCAL:
+        out << "n++;\n  AOT_PUSH(ctx->stackBase[" << getOperand(code, offset, 0)
+            << "]);";
+        break;
+
+      case OP_LOOP:
+        out << "n++;\n  ";
+        if (counters) {
+          out << "loops[" << getOperand(code, offset, 1) << "]++;\n  ";
+        }
+        out << "AOT_CHECK_FUEL();\n  goto " << target(0) << ";";
+        break;
+
+      case OP_FOR_STEP: {
+        auto counter =
+            "(*g[" + std::to_string(getOperand(code, offset, 0)) + "])";
+        out << "{\n    int64_t res;\n"
+            << "    if (IS_INT(" << counter << ") && IS_INT(sp[-1]) &&\n"
+            << "        !__builtin_add_overflow(AS_INT(" << counter
+            << "), 1, &res)) {\n"
+            << "      n++;\n      " << counter << " = INT(res);\n"
+            << "      if (res < AS_INT(sp[-1])) {\n";
+        if (counters) {
+          out << "        loops[" << getOperand(code, offset, 2) << "]++;\n";
+        }
+        out << "        AOT_CHECK_FUEL();\n"
+            << "        goto " << target(1) << ";\n      }\n"
+            << "    } else if (aotExec(ctx, " << address << ", sp, n) == "
+            << getOperand(code, offset, 1) << ") {\n"
+            << "      goto " << target(1) << ";\n    }\n  }";
+      } break;
+
+      case OP_DIV:
+      case OP_MAP_NEW:
+      case OP_MAP_GET:
+      case OP_MAP_SET:
+      case OP_MAP_HAS:
+      case OP_MAP_DELETE:
+      case OP_PMAP:
+      case OP_PREDUCE:
+      case OP_NEW_INSTANCE:
+      case OP_GET_PROP:
+      case OP_SET_PROP:
+      case OP_INIT_PROP:
+      case OP_STRING:
+      case OP_PRINT:
+        out << "aotExec(ctx, " << address << ", sp, n);";
+        break;
+
+      default:
+        DIE << "[EvaAot]: " << opcodeToString(opcode)
+            << " is not supported in native code";
+      }
+
+      out << "\n";
+    }
+
+    // Code objects end with OP_HALT
+    out << "  return BOOLEAN(false);\n}\n";
+    return out.str();
+  }
+
+  /**
+   * Compiles the source into a shared object with the system compiler
+   * ($CXX, or c++). The compiler is run directly with an argument
+   * vector (no shell), so paths are passed as they are.
+   */
+  void build(const std::string &source, const std::string &soPath) {
+    auto sourcePath = soPath + ".cpp";
+    std::ofstream file(sourcePath, std::ios::trunc);
+    if (!(file << source) || !file.flush()) {
+      DIE << "[EvaAot]: can't write " << sourcePath;
+    }
+
+    auto cxx = std::getenv("CXX");
+    std::vector<std::string> args = {cxx != nullptr ? cxx : "c++",
+                                     "-std=c++17",
+                                     "-O2",
+                                     "-fPIC",
+                                     "-shared",
+                                     "-w",
+                                     "-I" + std::string(EVA_SOURCE_DIR),
+                                     "-o",
+                                     soPath,
+                                     sourcePath};
+
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+      argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    auto error = posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(),
+                              environ);
+    if (error != 0) {
+      DIE << "[EvaAot]: can't run " << args[0] << ": " << strerror(error);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+      if (errno != EINTR) {
+        DIE << "[EvaAot]: can't wait for " << args[0] << ": "
+            << strerror(errno);
+      }
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      DIE << "[EvaAot]: compilation of " << sourcePath << " failed ("
+          << (WIFEXITED(status) ? "exit status " : "signal ")
+          << (WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status))
+          << ")";
+    }
+  }
+
+  /**
+   * Loads a shared object built from the code object
+   */
+  AotProgram load(const std::string &soPath, CodeObject *co) {
+    // Without a slash dlopen searches the library path
+    auto path = soPath.find('/') == std::string::npos ? "./" + soPath : soPath;
+    auto handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+      DIE << "[EvaAot]: can't load " << soPath << ": " << dlerror();
+    }
+
+    AotProgram program;
+    program.co = co;
+    program.handle = std::shared_ptr<void>(handle, dlclose);
+    program.entry = (EvaAotEntry)dlsym(handle, EVA_AOT_ENTRY);
+    if (program.entry == nullptr) {
+      DIE << "[EvaAot]: no " << EVA_AOT_ENTRY << " in " << soPath;
+    }
+    return program;
+  }
+
+private:
+  /**
+   * Constant expression: integers and booleans are baked in,
+   * other values are read from the pool
+   */
+  static std::string constant(CodeObject *co, size_t index) {
+    auto &value = co->constants[index];
+    if (IS_INT(value)) {
+      return "INT((int64_t)" + std::to_string((uint64_t)AS_INT(value)) +
+             "ull)";
+    }
+    if (IS_BOOLEAN(value)) {
+      return AS_BOOLEAN(value) ? "BOOLEAN(true)" : "BOOLEAN(false)";
+    }
+    return "k[" + std::to_string(index) + "]";
+  }
+
+  /**
+   * C++ operators by OP_COMPARE operand (see EvaCompiler::specialForms_)
+   */
+  static constexpr const char *compareOps_[] = {"<",  ">",  "==",
+                                                ">=", "<=", "!="};
+};
+
+#endif
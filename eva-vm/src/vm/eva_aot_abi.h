@@ -0,0 +1,145 @@
+/**
+ * Eva AOT ABI
+ *
+ * Interface between a native (ahead-of-time compiled) program and the
+ * VM running it. Included by the generated C++ source (see eva_aot.h),
+ * so it only depends on the value representation.
+ */
+
+#ifndef EVA_AOT_ABI__H
+#define EVA_AOT_ABI__H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "eva_value.h"
+
+struct EvaAotContext;
+
+/**
+ * Native entry point of a program
+ */
+using EvaAotEntry = EvaValue (*)(EvaAotContext *ctx);
+
+/**
+ * Symbol of the entry point in the shared object
+ */
+#define EVA_AOT_ENTRY "eva_aot_main"
+
+/**
+ * Registers of the VM, shared with native code. Native code keeps sp
+ * and the instruction count in locals, and syncs them on VM calls.
+ */
+struct EvaAotContext {
+  EvaValue *sp;
+  EvaValue *stackBase;
+  EvaValue *stackLimit;
+
+  /**
+   * Constant pool of the code object, and globals by index
+   */
+  const EvaValue *constants;
+  EvaValue **globals;
+
+  /**
+   * Back-edge counters by loop index, outcome counters (false, true)
+   * by branch index
+   */
+  uint64_t *loopCounters;
+  uint64_t *branchCounters;
+
+  /**
+   * Instructions executed, jumps taken, and the count of the next
+   * budget check
+   */
+  uint64_t instructions;
+  uint64_t jumps;
+  uint64_t fuelCheck;
+
+  void *vm;
+
+  /**
+   * Runs the instruction at the address in the interpreter (slow paths,
+   * heap objects), returns the address of the next instruction
+   */
+  size_t (*exec)(EvaAotContext *ctx, size_t address);
+
+  /**
+   * Budget check (throws when out of budget)
+   */
+  void (*outOfFuel)(EvaAotContext *ctx);
+
+  /**
+   * Runtime error (throws)
+   */
+  void (*error)(EvaAotContext *ctx, const char *message);
+};
+
+// ----------------------------------------------------------------------
+// Generated code helpers (locals: ctx, sp, n)
+
+#define AOT_PUSH(value)                                                        \
+  do {                                                                         \
+    if (sp == ctx->stackLimit) {                                               \
+      ctx->error(ctx, "push(): Stack overflow.\n");                            \
+    }                                                                          \
+    *sp++ = (value);                                                           \
+  } while (0)
+
+#define AOT_POP()                                                              \
+  (sp == ctx->stackBase ? (ctx->error(ctx, "pop(): empty stack.\n"), *sp)     \
+                        : *--sp)
+
+/**
+ * Integer fast path of OP_ADD, OP_SUB, OP_MUL (the interpreter
+ * handles other operands and overflow)
+ */
+#define AOT_INT_OP(checked, address)                                           \
+  do {                                                                         \
+    int64_t res;                                                               \
+    if (sp - ctx->stackBase >= 2 && IS_INT(sp[-2]) && IS_INT(sp[-1]) &&        \
+        !checked(AS_INT(sp[-2]), AS_INT(sp[-1]), &res)) {                      \
+      n++;                                                                     \
+      sp[-2] = INT(res);                                                       \
+      sp--;                                                                    \
+    } else {                                                                   \
+      aotExec(ctx, address, sp, n);                                            \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Integer fast path of OP_COMPARE
+ */
+#define AOT_INT_COMPARE(op, address)                                           \
+  do {                                                                         \
+    if (sp - ctx->stackBase >= 2 && IS_INT(sp[-2]) && IS_INT(sp[-1])) {        \
+      n++;                                                                     \
+      sp[-2] = BOOLEAN(AS_INT(sp[-2]) op AS_INT(sp[-1]));                      \
+      sp--;                                                                    \
+    } else {                                                                   \
+      aotExec(ctx, address, sp, n);                                            \
+    }                                                                          \
+  } while (0)
+
+#define AOT_CHECK_FUEL()                                                       \
+  do {                                                                         \
+    if (n >= ctx->fuelCheck) {                                                 \
+      ctx->instructions = n;                                                   \
+      ctx->outOfFuel(ctx);                                                     \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Runs an instruction in the interpreter, syncing the registers
+ */
+inline size_t aotExec(EvaAotContext *ctx, size_t address, EvaValue *&sp,
+                      uint64_t &n) {
+  ctx->sp = sp;
+  ctx->instructions = n;
+  auto next = ctx->exec(ctx, address);
+  sp = ctx->sp;
+  n = ctx->instructions;
+  return next;
+}
+
+#endif
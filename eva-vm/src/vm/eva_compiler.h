@@ -8,10 +8,21 @@
 #include "../bytecode/op_code.h"
 #include "../disassembler/eva_disassembler.h"
 #include "../parser/eva_parser.h"
+#include "eva_fiber.h"
+#include "eva_heap.h"
+#include "eva_policy.h"
+#include "eva_profile.h"
+#include "eva_string.h"
 #include "eva_value.h"
 #include "global.h"
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #define ALLOC_CONST(tester, converter, allocator, value)                       \
@@ -24,6 +35,7 @@
         return i;                                                              \
       }                                                                        \
     }                                                                          \
+    reserveCode(co, co->constants, 1);                                         \
     co->constants.push_back(allocator(value));                                 \
   } while (0);
 
@@ -35,14 +47,114 @@
     emit(op);                                                                  \
   } while (0)
 
+// Fixed arity operation: (map-get m k) OP_GET_GLOBAL, OP_CONST, OP_MAP_GET
+#define GEN_FIXED_OP(op, arity)                                                \
+  do {                                                                         \
+    if (exp.list.size() != arity) {                                            \
+      DIE << "[EvaCompiler]: " << tag.string << " expects " << (arity - 1)     \
+          << " arguments";                                                     \
+    }                                                                          \
+    for (auto i = 1; i < arity; i++) {                                         \
+      gen(exp.list[i]);                                                        \
+    }                                                                          \
+    emit(op);                                                                  \
+  } while (0)
+
+/**
+ * Special forms, dispatched by the symbol ID of the list tag
+ */
+enum class FormType : uint8_t {
+  NONE,
+  ADD,
+  SUB,
+  MUL,
+  DIV,
+  COMPARE,
+  IF,
+  WHILE,
+  FOR,
+  VAR,
+  SET,
+  MAP,
+  MAP_GET,
+  MAP_SET,
+  MAP_HAS,
+  MAP_DELETE,
+  SPAWN,
+  YIELD,
+  JOIN,
+  PMAP,
+  PREDUCE,
+  OBJECT,
+  PROP,
+  STRING,
+  PRINT,
+};
+
+struct SpecialForm {
+  FormType type = FormType::NONE;
+
+  /**
+   * Instruction operand (compare operator, string builtin)
+   */
+  uint8_t operand = 0;
+
+  /**
+   * Side effects (not allowed in pmap/preduce bodies)
+   */
+  bool sideEffect = false;
+};
+
+/**
+ * Operand stack at the emitted code: depth, and the slots available
+ * (the VM stack, or the stack of a spawned fiber)
+ */
+struct StackFrame {
+  size_t depth;
+  size_t size;
+};
+
+/**
+ * Unlikely branch of an `if`, emitted at the end of the code object
+ */
+struct ColdBlock {
+  /**
+   * Conditional jump to the block (offset), and the address
+   * the block jumps back to
+   */
+  size_t jumpOffset;
+  size_t endAddr;
+
+  /**
+   * Branch expression, nullptr for an absent alternate (false)
+   */
+  const Exp *exp;
+
+  /**
+   * Operand stack at the jump
+   */
+  StackFrame stack;
+};
+
+/**
+ * Body of a callable, kept until its first call
+ */
+struct LazyCode {
+  std::unique_ptr<Exp> body;
+  std::vector<std::string> params;
+  std::once_flag compiled;
+};
+
 /**
  * Compiler class, emits bytecode, records constant pool, vars, etc.
  */
-class EvaCompiler {
+template <typename Policy = DefaultPolicy> class EvaCompiler {
 public:
-  EvaCompiler(std::shared_ptr<Global> global)
-      : disassembler(std::make_unique<EvaDisassembler>(global)),
-        global(global) {}
+  EvaCompiler(std::shared_ptr<Global> global) : global(global) {
+    if constexpr (Policy::disassemble) {
+      disassembler = std::make_unique<EvaDisassembler>(global);
+    }
+  }
 
   /**
    * Main compile API
@@ -50,16 +162,203 @@ public:
   CodeObject *compile(const Exp &exp) {
     // Allocate new code object
     co = AS_CODE(ALLOC_CODE("main"));
+    stack = {0, STACK_LIMIT};
+
+    // Generate recursively from top-level, with an explicit
+    // VM-stop marker
+    genChecked(exp, true);
 
-    // Generate recursively from top-level
-    gen(exp);
+    genColdBlocks();
 
-    // Explicit VM-stop marker
-    emit(OP_HALT);
+    return co;
+  }
 
+  /**
+   * Starts incremental compilation: top-level forms are appended
+   * to one running code object
+   */
+  CodeObject *beginIncremental(const std::string &name = "main") {
+    co = AS_CODE(ALLOC_CODE(name));
     return co;
   }
 
+  /**
+   * Appends a top-level form to the running code object,
+   * returns the entry address of the form
+   */
+  size_t compileForm(const Exp &exp) {
+    auto entry = getOffset();
+    auto size = co->code.size();
+    auto loops = co->loops.size();
+    auto branches = co->branches.size();
+    auto caches = co->propertyCaches.size();
+    auto globals = global->size();
+
+    // Each form starts on an empty stack
+    stack = {0, STACK_LIMIT};
+
+    try {
+      // Each form stops the VM with its own result
+      genChecked(exp, true);
+
+      genColdBlocks();
+    } catch (const EvaError &) {
+      // Discard the partial form, the running code stays valid
+      co->code.resize(size);
+      co->loops.resize(loops);
+      co->branches.resize(branches);
+      co->propertyCaches.erase(co->propertyCaches.begin() + caches,
+                               co->propertyCaches.end());
+      coldBlocks.clear();
+      global->truncate(globals);
+      throw;
+    }
+
+    return entry;
+  }
+
+  /**
+   * Compiles a top-level form into a code object of its own, used to
+   * run a stream of forms one by one (code and constants of earlier
+   * forms don't accumulate)
+   */
+  CodeObject *compileStreamed(const Exp &exp) {
+    co = AS_CODE(ALLOC_CODE("main"));
+    auto globals = global->size();
+    stack = {0, STACK_LIMIT};
+
+    try {
+      genChecked(exp, true);
+      genColdBlocks();
+    } catch (const EvaError &) {
+      freeObject(co);
+      co = nullptr;
+      coldBlocks.clear();
+      global->truncate(globals);
+      throw;
+    }
+    return co;
+  }
+
+  /**
+   * Compiles a form into a standalone unit (no OP_HALT), used by
+   * the parallel compiler. Globals must be resolved beforehand.
+   */
+  CodeObject *compileUnit(const Exp &exp) {
+    co = AS_CODE(ALLOC_CODE("unit"));
+    wideConstants = true;
+    stack = {0, STACK_LIMIT};
+    genChecked(exp);
+
+    // Units are linked one after another, so cold blocks are skipped
+    if (!coldBlocks.empty()) {
+      auto endAddr = emit(OP_JMP, 0);
+      genColdBlocks();
+      patchJumpAddress(endAddr, getOffset());
+    }
+    return co;
+  }
+
+  /**
+   * Creates a side-effect free callable (a pmap/preduce body), with
+   * its own code object. Parameters are locals 0..N-1.
+   *
+   * The body is only checked here (references, side effects), its
+   * bytecode is generated on the first call (see compileLazy).
+   */
+  CodeObject *compileCallable(const std::string &name,
+                              const std::vector<std::string> &callableParams,
+                              const Exp &body) {
+    auto prevParams = std::move(params);
+    params = callableParams;
+    try {
+      resolve(body);
+    } catch (const EvaError &) {
+      params = std::move(prevParams);
+      throw;
+    }
+    params = std::move(prevParams);
+
+    auto callable = AS_CODE(ALLOC_CODE(name));
+    callable->lazy = std::make_shared<LazyCode>();
+    callable->lazy->body = std::make_unique<Exp>(body);
+    callable->lazy->params = callableParams;
+    return callable;
+  }
+
+  /**
+   * Generates the bytecode of a lazy callable, once (concurrent
+   * callers wait for it). After an error the next call retries.
+   */
+  void compileLazy(CodeObject *callable) {
+    auto lazy = callable->lazy.get();
+
+    std::call_once(lazy->compiled, [&]() {
+      auto prevCo = co;
+      auto prevParams = std::move(params);
+      auto prevColdBlocks = std::move(coldBlocks);
+      auto prevStack = stack;
+
+      co = callable;
+      params = lazy->params;
+      coldBlocks.clear();
+
+      // Arguments are pushed onto the VM stack
+      stack = {params.size(), STACK_LIMIT};
+
+      auto restore = [&]() {
+        co = prevCo;
+        params = std::move(prevParams);
+        coldBlocks = std::move(prevColdBlocks);
+        stack = prevStack;
+      };
+
+      try {
+        genChecked(*lazy->body, true);
+        genColdBlocks();
+      } catch (const EvaError &) {
+        // Back to a stub
+        callable->constants.clear();
+        callable->code.clear();
+        callable->loops.clear();
+        callable->branches.clear();
+        callable->propertyCaches.clear();
+        restore();
+        throw;
+      }
+
+      restore();
+
+      // Only the bytecode is needed from now on
+      lazy->body.reset();
+    });
+  }
+
+  /**
+   * Resolves globals of a form without emitting code: defines `var`
+   * names and reports reference errors in the same order as `gen`.
+   */
+  void resolveGlobals(const Exp &exp) {
+    try {
+      resolve(exp);
+    } catch (EvaError &error) {
+      error.kind = EvaErrorKind::COMPILE;
+      throw;
+    }
+  }
+
+  /**
+   * Currently compiling code object
+   */
+  CodeObject *getCode() { return co; }
+
+  /**
+   * Branch profile guiding the layout of `if` (nullptr: source order)
+   */
+  void setProfile(std::shared_ptr<const BranchProfile> branchProfile) {
+    profile = std::move(branchProfile);
+  }
+
   /**
    * Main compile loop
    */
@@ -70,8 +369,15 @@ public:
        * Numbers
        */
     case ExpType::NUMBER: {
-      emit(OP_CONST);
-      emit(numericConstIdx(exp.number));
+      emitConst(numericConstIdx(exp.number));
+    } break;
+
+      /**
+       * --------------------------------------------------
+       * Integers
+       */
+    case ExpType::INT: {
+      emitConst(intConstIdx(exp.integer));
     } break;
 
       /**
@@ -79,8 +385,7 @@ public:
        * String
        */
     case ExpType::STRING: {
-      emit(OP_CONST);
-      emit(stringConstIdx(exp.string));
+      emitConst(stringConstIdx(exp.string));
     } break;
 
       /**
@@ -92,18 +397,23 @@ public:
        * Boolean
        */
       if (exp.string == "true" || exp.string == "false") {
-        emit(OP_CONST);
-        emit(booleanConstIdx(exp.string == "true" ? true : false));
+        emitConst(booleanConstIdx(exp.string == "true" ? true : false));
       } else {
         // Variables:
 
-        // 1. Global vars:
+        // 1. Parameters of a callable:
+        auto paramIndex = getParamIndex(exp.string);
+        if (paramIndex != -1) {
+          emit(OP_GET_LOCAL, paramIndex);
+          break;
+        }
+
+        // 2. Global vars:
         if (!global->exists(exp.string)) {
           DIE << "[EvaCompiler]: Reference error: " << exp.string;
         }
 
-        emit(OP_GET_GLOBAL);
-        emit(global->getGlobalIndex(exp.string));
+        emitGlobal(OP_GET_GLOBAL, global->getGlobalIndex(exp.string));
       }
       break;
 
@@ -112,92 +422,203 @@ public:
      * List
      */
     case ExpType::LIST:
-      auto tag = exp.list[0];
+      if (exp.list.empty()) {
+        DIE << "[EvaCompiler]: empty form ()";
+      }
+
+      auto &tag = exp.list[0];
 
       /**
        * --------------------------------------------------
        * Special cases
        */
       if (tag.type == ExpType::SYMBOL) {
-        auto op = tag.string;
+        auto &form = specialForm(tag);
+
+        // Callables run in parallel, and may only read globals
+        if (!params.empty() && form.sideEffect) {
+          DIE << "[EvaCompiler]: " << tag.string
+              << " is not allowed in a pmap/preduce body";
+        }
 
+        checkArity(exp, form.type);
+
+        switch (form.type) {
         // --------------------------------------------------
         // Binary math operations:
 
-        if (op == "+") {
+        case FormType::ADD:
           GEN_BINARY_OP(OP_ADD);
-        }
+          break;
 
-        else if (op == "-") {
+        case FormType::SUB:
           GEN_BINARY_OP(OP_SUB);
-        }
+          break;
 
-        else if (op == "*") {
+        case FormType::MUL:
           GEN_BINARY_OP(OP_MUL);
-        }
+          break;
 
-        else if (op == "/") {
+        case FormType::DIV:
           GEN_BINARY_OP(OP_DIV);
-        }
+          break;
 
         // --------------------------------------------------
         // Compare operations (> 5 10)
 
-        else if (compareOps_.count(op) != 0) {
+        case FormType::COMPARE:
           gen(exp.list[1]);
           gen(exp.list[2]);
-          emit(OP_COMPARE);
-          emit(compareOps_[op]);
-        }
+          emit(OP_COMPARE, form.operand);
+          break;
 
         // --------------------------------------------------
         // Branch instruction
 
         /**
          * (if <test> <consequent> <alternate>)
+         *
+         *         <test> OP_JMP_IF_ELSE else <consequent> OP_JMP end
+         *   else: <alternate>
+         *   end:
+         *
+         * When the profile has the branch, the likely side falls through
+         * to the end, and the other one is moved to the end of the code
+         * object (OP_JMP_IF_TRUE if the alternate is likely):
+         *
+         *         <test> OP_JMP_IF_ELSE cold <consequent>
+         *   end:  ...
+         *   cold: <alternate> OP_JMP end
          */
-        else if (op == "if") {
+        case FormType::IF: {
+          auto branch = newBranch(exp);
+
           // Emit <test>
           gen(exp.list[1]);
 
-          // Else branch. Init with 0 address, will be patched
-          emit(OP_JMP_IF_ELSE);
+          auto alternate = exp.list.size() == 4 ? &exp.list[3] : nullptr;
+
+          auto likely = likelyOutcome(co->branches[branch]);
+          if (likely.has_value()) {
+            auto consequent = &exp.list[2];
+            auto cold = *likely ? alternate : consequent;
 
-          // NOTE: we use 2-bytes adresses
-          emit(0);
-          emit(0);
+            auto coldJmpAddr =
+                emit(*likely ? OP_JMP_IF_ELSE : OP_JMP_IF_TRUE, 0, branch);
+            auto coldStack = stack;
 
-          auto elseJmpAddr = getOffset() - 2;
+            // Globals the cold side defines are visible to the code
+            // which follows it in the source
+            if (cold == consequent) {
+              resolve(*consequent);
+            }
+            genBranch(*likely ? consequent : alternate);
+            if (cold == alternate && alternate != nullptr) {
+              resolve(*alternate);
+            }
+
+            coldBlocks.push_back({coldJmpAddr, getOffset(), cold, coldStack});
+            break;
+          }
+
+          // Else branch. Init with 0 address, will be patched
+          auto elseJmpAddr = emit(OP_JMP_IF_ELSE, 0, branch);
+          auto elseStack = stack;
 
           // Emit <consequent>
           gen(exp.list[2]);
 
-          emit(OP_JMP);
-
-          // 2-byte addrees
-          emit(0);
-          emit(0);
+          auto endAddr = emit(OP_JMP, 0);
 
-          auto endAddr = getOffset() - 2;
+          // <alternate> starts on the stack of the jump to it
+          stack = elseStack;
 
           // Patch the else branch address
           auto elseBranchAddr = getOffset();
           patchJumpAddress(elseJmpAddr, elseBranchAddr);
 
-          // Emit <alternate> if we have it
-          if (exp.list.size() == 4) {
-            gen(exp.list[3]);
-          }
+          // Emit <alternate> if we have it, otherwise false
+          genBranch(alternate);
 
           // Patch the end
           auto endBranchAddr = getOffset();
           patchJumpAddress(endAddr, endBranchAddr);
-        }
+        } break;
+
+        // ----------------------------------------------
+        // Loops (evaluate to false)
+
+        /**
+         * (while <test> <body>)
+         *
+         *   loop: <test> OP_JMP_IF_ELSE end <body> OP_POP OP_LOOP loop
+         *   end:  false
+         */
+        case FormType::WHILE: {
+          if (exp.list.size() != 3) {
+            DIE << "[EvaCompiler]: while expects (while <test> <body>)";
+          }
+
+          auto branch = newBranch(exp);
+          auto loopAddr = getOffset();
+
+          gen(exp.list[1]);
+
+          auto endJmpAddr = emit(OP_JMP_IF_ELSE, 0, branch);
+
+          gen(exp.list[2]);
+          emit(OP_POP);
+
+          emit(OP_LOOP, loopAddr, newLoop(loopAddr));
+
+          patchJumpAddress(endJmpAddr, getOffset());
+
+          emitConst(booleanConstIdx(false));
+        } break;
+
+        /**
+         * (for i <start> <end> <body>): global i from start while i < end
+         *
+         *         <end> <start> 1 OP_SUB OP_SET_GLOBAL i OP_POP OP_JMP step
+         *   body: <body> OP_POP
+         *   step: OP_FOR_STEP i body (i += 1, loop while i < end)
+         *         OP_POP false
+         */
+        case FormType::FOR: {
+          auto varName = exp.list[1].string;
+          global->define(varName);
+          auto globalIndex = global->getGlobalIndex(varName);
+
+          // The end stays on the stack during the loop
+          gen(exp.list[3]);
+
+          // The first step increments to the start
+          gen(exp.list[2]);
+          emitConst(intConstIdx(1));
+          emit(OP_SUB);
+          emitGlobal(OP_SET_GLOBAL, globalIndex);
+          emit(OP_POP);
+
+          auto stepJmpAddr = emit(OP_JMP, 0);
+
+          auto bodyAddr = getOffset();
+          gen(exp.list[4]);
+          emit(OP_POP);
+
+          patchJumpAddress(stepJmpAddr, getOffset());
+
+          emit(OP_FOR_STEP, globalIndex, bodyAddr, newLoop(bodyAddr));
+
+          // Pop the end
+          emit(OP_POP);
+
+          emitConst(booleanConstIdx(false));
+        } break;
 
         // ----------------------------------------------
         // Variable declaration: (var x (+ y 10))
 
-        else if (op == "var") {
+        case FormType::VAR: {
 
           auto varName = exp.list[1].string;
           // 1. Global vars:
@@ -207,17 +628,25 @@ public:
           // Initializer
           gen(exp.list[2]);
 
-          emit(OP_SET_GLOBAL);
-          emit(global->getGlobalIndex(varName));
+          emitGlobal(OP_SET_GLOBAL, global->getGlobalIndex(varName));
 
           // 2. Local vars: (TODO)
 
-        }
+        } break;
 
         // ----------------------------------------------
         // Variable update: (set x 100)
 
-        else if (op == "set") {
+        case FormType::SET: {
+          // Property: (set (prop p x) 100)
+          if (isPropertyAccess(exp.list[1])) {
+            auto &target = exp.list[1];
+            gen(target.list[1]);
+            gen(exp.list[2]);
+            emit(OP_SET_PROP, newPropertyCache(target.list[2]));
+            break;
+          }
+
           // 1. Global vars:
 
           auto varName = exp.list[1].string;
@@ -229,11 +658,180 @@ public:
           if (globalIndex == -1) {
             DIE << "Reference error: " << varName << " is not defined.";
           }
-          emit(OP_SET_GLOBAL);
-          emit(globalIndex);
+          emitGlobal(OP_SET_GLOBAL, globalIndex);
 
           // 2. Local vars: (TODO)
+        } break;
+
+        // ----------------------------------------------
+        // Map literal: (map "a" 1 "b" 2)
+
+        case FormType::MAP: {
+          auto pairs = (exp.list.size() - 1) / 2;
+          if ((exp.list.size() - 1) % 2 != 0 || pairs > 0xFF) {
+            DIE << "[EvaCompiler]: map expects up to 255 key/value pairs";
+          }
+
+          for (auto i = 1; i < exp.list.size(); i++) {
+            gen(exp.list[i]);
+          }
+
+          emit(OP_MAP_NEW, pairs);
+        } break;
+
+        // ----------------------------------------------
+        // Instance literal: (object x 1 y 2)
+
+        case FormType::OBJECT: {
+          auto count = (exp.list.size() - 1) / 2;
+          if ((exp.list.size() - 1) % 2 != 0 || count > 0xFF) {
+            DIE << "[EvaCompiler]: object expects up to 255 name/value pairs";
+          }
+
+          emit(OP_NEW_INSTANCE, count);
+
+          for (auto i = 1; i < exp.list.size(); i += 2) {
+            gen(exp.list[i + 1]);
+            emit(OP_INIT_PROP, newPropertyCache(exp.list[i]));
+          }
+        } break;
+
+        // ----------------------------------------------
+        // Property access: (prop p x)
+
+        case FormType::PROP:
+          if (!isPropertyAccess(exp)) {
+            DIE << "[EvaCompiler]: prop expects (prop <instance> <name>)";
+          }
+          gen(exp.list[1]);
+          emit(OP_GET_PROP, newPropertyCache(exp.list[2]));
+          break;
+
+        // ----------------------------------------------
+        // Map access: (map-get m k), (map-set m k v),
+        // (map-has m k), (map-delete m k)
+
+        case FormType::MAP_GET:
+          GEN_FIXED_OP(OP_MAP_GET, 3);
+          break;
+
+        case FormType::MAP_SET:
+          GEN_FIXED_OP(OP_MAP_SET, 4);
+          break;
+
+        case FormType::MAP_HAS:
+          GEN_FIXED_OP(OP_MAP_HAS, 3);
+          break;
+
+        case FormType::MAP_DELETE:
+          GEN_FIXED_OP(OP_MAP_DELETE, 3);
+          break;
+
+        // ----------------------------------------------
+        // String builtins: (substring s 0 3), (string-split s ",") ...
+
+        case FormType::STRING: {
+          auto arity = stringBuiltinArity(form.operand);
+          if (exp.list.size() != arity + 1) {
+            DIE << "[EvaCompiler]: " << tag.string << " expects " << arity
+                << " arguments";
+          }
+          for (size_t i = 1; i <= arity; i++) {
+            gen(exp.list[i]);
+          }
+          emit(OP_STRING, form.operand);
+        } break;
+
+        // ----------------------------------------------
+        // Output: (print "x =" x), a line of the values
+
+        case FormType::PRINT: {
+          auto count = exp.list.size() - 1;
+          if (count > 0xFF) {
+            DIE << "[EvaCompiler]: print expects up to 255 values";
+          }
+          for (size_t i = 1; i <= count; i++) {
+            gen(exp.list[i]);
+          }
+          emit(OP_PRINT, count);
+        } break;
+
+        // ----------------------------------------------
+        // Fibers: (spawn <body>), (yield), (join f)
+
+        /**
+         * The body is compiled inline, the spawning fiber jumps over it:
+         *
+         *   OP_SPAWN <end> <body> OP_FIBER_END <end>: ...
+         */
+        case FormType::SPAWN: {
+          if (exp.list.size() != 2) {
+            DIE << "[EvaCompiler]: spawn expects 1 argument";
+          }
+
+          auto endAddr = emit(OP_SPAWN, 0);
+
+          // The body runs on the fiber's own stack
+          auto spawnerStack = stack;
+          stack = {0, FIBER_STACK_SIZE};
+
+          gen(exp.list[1]);
+          emit(OP_FIBER_END);
+
+          stack = spawnerStack;
+
+          patchJumpAddress(endAddr, getOffset());
+        } break;
+
+        case FormType::YIELD:
+          GEN_FIXED_OP(OP_YIELD, 1);
+          break;
+
+        case FormType::JOIN:
+          GEN_FIXED_OP(OP_JOIN, 2);
+          break;
+
+        // ----------------------------------------------
+        // Parallel builtins: (pmap x <input> <body>),
+        // (preduce acc x <input> <init> <body>)
+        //
+        // Input is an array-like map (keys 0..N-1), or a count N.
+        // The body is compiled into a callable constant.
+
+        case FormType::PMAP: {
+          if (exp.list.size() != 4) {
+            DIE << "[EvaCompiler]: pmap expects (pmap x <input> <body>)";
+          }
+
+          gen(exp.list[2]);
+
+          emitConst(codeConstIdx(
+              compileCallable("pmap", {exp.list[1].string}, exp.list[3])));
+
+          emit(OP_PMAP);
+        } break;
+
+        case FormType::PREDUCE: {
+          if (exp.list.size() != 6) {
+            DIE << "[EvaCompiler]: preduce expects "
+                << "(preduce acc x <input> <init> <body>)";
+          }
+
+          gen(exp.list[3]);
+          gen(exp.list[4]);
+
+          emitConst(codeConstIdx(compileCallable(
+              "preduce", {exp.list[1].string, exp.list[2].string},
+              exp.list[5])));
+
+          emit(OP_PREDUCE);
+        } break;
+
+        case FormType::NONE:
+          DIE << "[EvaCompiler]: unknown form: " << tag.string;
         }
+      } else {
+        DIE << "[EvaCompiler]: a list must start with a form name";
       }
       break;
     }
@@ -242,33 +840,203 @@ public:
   /**
    * Disassemble all compilation units
    */
-  void disassembleBytecode() { disassembler->disassemble(co); }
+  void disassembleBytecode() {
+    if constexpr (Policy::disassemble) {
+      disassembler->disassemble(co);
+    }
+  }
 
 private:
   /**
-   * Disassembler
+   * Disassembler (nullptr if the policy has no disassembly)
    */
   std::unique_ptr<EvaDisassembler> disassembler;
 
   /**
-   * Returns current bytecode offset
+   * Generates code (followed by OP_HALT if halt), errors are
+   * reported as compile errors
+   */
+  void genChecked(const Exp &exp, bool halt = false) {
+    try {
+      gen(exp);
+      if (halt) {
+        emit(OP_HALT);
+      }
+    } catch (EvaError &error) {
+      error.kind = EvaErrorKind::COMPILE;
+      throw;
+    }
+  }
+
+  /**
+   * Resolves globals of a form (see resolveGlobals)
+   */
+  void resolve(const Exp &exp) {
+    switch (exp.type) {
+    case ExpType::SYMBOL:
+      if (exp.string != "true" && exp.string != "false" &&
+          getParamIndex(exp.string) == -1 && !global->exists(exp.string)) {
+        DIE << "[EvaCompiler]: Reference error: " << exp.string;
+      }
+      break;
+
+    case ExpType::LIST: {
+      if (exp.list.empty()) {
+        break;
+      }
+
+      auto form = specialForm(exp.list[0]).type;
+
+      // As in gen: callables may only read globals
+      if (!params.empty() && specialForm(exp.list[0]).sideEffect) {
+        DIE << "[EvaCompiler]: " << exp.list[0].string
+            << " is not allowed in a pmap/preduce body";
+      }
+
+      checkArity(exp, form);
+
+      if (form == FormType::VAR) {
+        global->define(exp.list[1].string);
+        resolve(exp.list[2]);
+      } else if (form == FormType::FOR) {
+        global->define(exp.list[1].string);
+        for (auto i = 2; i < exp.list.size(); i++) {
+          resolve(exp.list[i]);
+        }
+      } else if (form == FormType::SET && isPropertyAccess(exp.list[1])) {
+        resolve(exp.list[1].list[1]);
+        resolve(exp.list[2]);
+      } else if (form == FormType::SET) {
+        resolve(exp.list[2]);
+        if (!global->exists(exp.list[1].string)) {
+          DIE << "Reference error: " << exp.list[1].string
+              << " is not defined.";
+        }
+      } else if (form == FormType::OBJECT) {
+        // Names are properties, not variables
+        for (auto i = 2; i < exp.list.size(); i += 2) {
+          resolve(exp.list[i]);
+        }
+      } else if (form == FormType::PROP) {
+        resolve(exp.list[1]);
+      } else if (form == FormType::PMAP || form == FormType::PREDUCE) {
+        // Inputs, then the body with its parameters
+        auto paramsCount = form == FormType::PMAP ? 1 : 2;
+        for (auto i = paramsCount + 1; i < exp.list.size() - 1; i++) {
+          resolve(exp.list[i]);
+        }
+        auto prevParams = std::move(params);
+        params.clear();
+        for (auto i = 1; i <= paramsCount; i++) {
+          params.push_back(exp.list[i].string);
+        }
+        resolve(exp.list.back());
+        params = std::move(prevParams);
+      } else {
+        for (auto i = 1; i < exp.list.size(); i++) {
+          resolve(exp.list[i]);
+        }
+      }
+    } break;
+
+    default:
+      break;
+    }
+  }
+
+  /**
+   * Checks the number of items of the forms which are taken apart
+   * by position (other forms check their own)
    */
-  size_t getOffset() { return co->code.size(); }
+  static void checkArity(const Exp &exp, FormType form) {
+    auto size = exp.list.size();
+    switch (form) {
+    case FormType::ADD:
+    case FormType::SUB:
+    case FormType::MUL:
+    case FormType::DIV:
+    case FormType::COMPARE:
+      if (size != 3) {
+        DIE << "[EvaCompiler]: " << exp.list[0].string
+            << " expects 2 arguments";
+      }
+      break;
+
+    case FormType::IF:
+      if (size != 3 && size != 4) {
+        DIE << "[EvaCompiler]: if expects "
+            << "(if <test> <consequent> [<alternate>])";
+      }
+      break;
+
+    case FormType::FOR:
+      if (size != 5) {
+        DIE << "[EvaCompiler]: for expects (for i <start> <end> <body>)";
+      }
+      break;
+
+    case FormType::VAR:
+      if (size != 3) {
+        DIE << "[EvaCompiler]: var expects (var <name> <value>)";
+      }
+      break;
+
+    case FormType::SET:
+      if (size != 3) {
+        DIE << "[EvaCompiler]: set expects (set <name> <value>)";
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  /**
+   * Returns the address of the next instruction (in code units)
+   */
+  size_t getOffset() { return co->code.size() / CODE_UNIT; }
 
   /**
    * Allocates a numeric constant
    */
   size_t numericConstIdx(double value) {
-    ALLOC_CONST(IS_NUMBER, AS_NUMBER, NUMBER, value);
+    // Keyed by exact bits, so 0 and -0 are different constants
+    for (auto i = 0; i < co->constants.size(); i++) {
+      if (IS_NUMBER(co->constants[i]) &&
+          memcmp(&co->constants[i].number, &value, sizeof(value)) == 0) {
+        return i;
+      }
+    }
+    reserveCode(co, co->constants, 1);
+    co->constants.push_back(NUMBER(value));
+    return co->constants.size() - 1;
+  }
+  /**
+   * Allocates an integer constant
+   */
+  size_t intConstIdx(int64_t value) {
+    ALLOC_CONST(IS_INT, AS_INT, INT, value);
     return co->constants.size() - 1;
   }
   /**
    * Allocates a string constant
    */
-  size_t stringConstIdx(const std::string &value) {
-    ALLOC_CONST(IS_STRING, AS_CPPSTRING, ALLOC_STRING, value);
+  size_t stringConstIdx(std::string_view value) {
+    ALLOC_CONST(IS_STRING, AS_CPPSTRING, internString, value);
     return co->constants.size() - 1;
   }
+
+  /**
+   * String value: the frozen string if one exists, else a new one
+   */
+  EvaValue internString(std::string_view value) {
+    auto frozen = global->frozenString(value);
+    if (frozen != nullptr) {
+      return (EvaValue){.type = EvaValueType::OBJECT, .object = frozen};
+    }
+    return ALLOC_STRING(value);
+  }
   /**
    * Allocates a boolean constant
    */
@@ -278,23 +1046,218 @@ private:
   }
 
   /**
-   * Emits data to the bytecode
+   * Adds a code object (callable) constant
+   */
+  size_t codeConstIdx(CodeObject *callable) {
+    reserveCode(co, co->constants, 1);
+    co->constants.push_back(
+        (EvaValue){.type = EvaValueType::OBJECT, .object = callable});
+    return co->constants.size() - 1;
+  }
+
+  /**
+   * Index of a parameter of the compiling callable (-1 if none)
+   */
+  int getParamIndex(const std::string &name) {
+    for (auto i = (int)params.size() - 1; i >= 0; i--) {
+      if (params[i] == name) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * Emits an instruction with its operands (see the encoding in
+   * op_code.h), returns its offset in the bytecode
+   */
+  template <typename... Operands>
+  size_t emit(uint8_t opcode, Operands... operands) {
+    std::initializer_list<size_t> values = {(size_t)operands...};
+    growStack(opcode, values.size() != 0 ? *values.begin() : 0);
+    reserveCode(co, co->code, opcodeSize(opcode));
+    return emitInstruction(co->code, opcode, values);
+  }
+
+  /**
+   * Tracks the operand stack depth after the instruction, rejects
+   * code which needs more stack than it runs on
+   */
+  void growStack(uint8_t opcode, size_t operand) {
+    auto effect = stackEffect(opcode, operand);
+    if (effect < 0 && stack.depth < (size_t)-effect) {
+      DIE << "[EvaCompiler]: internal error: " << opcodeToString(opcode)
+          << " pops an empty stack";
+    }
+    stack.depth += effect;
+    if (stack.depth > stack.size) {
+      DIE << "[EvaCompiler]: expression is nested too deep (needs more "
+          << "than " << stack.size << " stack slots)";
+    }
+    co->maxStack = std::max(co->maxStack, stack.depth);
+  }
+
+  /**
+   * Values pushed minus popped by an instruction (its first operand)
+   */
+  static int64_t stackEffect(uint8_t opcode, size_t operand) {
+    switch (opcode) {
+    case OP_CONST:
+    case OP_CONST_WIDE:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_WIDE:
+    case OP_GET_LOCAL:
+    case OP_SPAWN:
+    case OP_YIELD:
+    case OP_NEW_INSTANCE:
+      return 1;
+    case OP_MAP_NEW:
+      return 1 - 2 * (int64_t)operand;
+    case OP_STRING:
+      return 1 - (int64_t)stringBuiltinArity(operand);
+    case OP_PRINT:
+      return 1 - (int64_t)operand;
+    case OP_MAP_SET:
+    case OP_PREDUCE:
+      return -2;
+    case OP_JMP:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_WIDE:
+    case OP_JOIN:
+    case OP_LOOP:
+    case OP_FOR_STEP:
+    case OP_GET_PROP:
+      return 0;
+    case OP_HALT:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_COMPARE:
+    case OP_JMP_IF_ELSE:
+    case OP_JMP_IF_TRUE:
+    case OP_MAP_GET:
+    case OP_MAP_HAS:
+    case OP_MAP_DELETE:
+    case OP_POP:
+    case OP_FIBER_END:
+    case OP_PMAP:
+    case OP_SET_PROP:
+    case OP_INIT_PROP:
+      return -1;
+    }
+    DIE << "[EvaCompiler]: unknown opcode " << (int)opcode;
+    return 0; // Unreachable
+  }
+
+  /**
+   * Pushes a constant: OP_CONST_WIDE past 256 constants, and in units,
+   * since the linker renumbers their constants into a merged pool
+   */
+  size_t emitConst(size_t index) {
+    return emit(index > 0xFF || wideConstants ? OP_CONST_WIDE : OP_CONST,
+                index);
+  }
+
+  /**
+   * Global access (OP_GET_GLOBAL, OP_SET_GLOBAL): the wide form past
+   * 256 globals
+   */
+  size_t emitGlobal(uint8_t opcode, size_t index) {
+    if (index > 0xFF) {
+      opcode =
+          opcode == OP_GET_GLOBAL ? OP_GET_GLOBAL_WIDE : OP_SET_GLOBAL_WIDE;
+    }
+    return emit(opcode, index);
+  }
+
+  /**
+   * Patches the address of the jump instruction at offset
+   */
+  void patchJumpAddress(size_t offset, size_t value) {
+    setOperand(co->code, offset, 0, value);
+  }
+
+  /**
+   * Adds an inline cache of a property, returns its index
+   */
+  size_t newPropertyCache(const Exp &name) {
+    if (name.type != ExpType::SYMBOL) {
+      DIE << "[EvaCompiler]: property name must be a symbol";
+    }
+    reserveCode(co, co->propertyCaches, 1);
+    co->propertyCaches.emplace_back(name.symbol);
+    return co->propertyCaches.size() - 1;
+  }
+
+  /**
+   * Whether the expression is (prop <instance> <name>)
+   */
+  static bool isPropertyAccess(const Exp &exp) {
+    return exp.type == ExpType::LIST && exp.list.size() == 3 &&
+           specialForm(exp.list[0]).type == FormType::PROP &&
+           exp.list[2].type == ExpType::SYMBOL;
+  }
+
+  /**
+   * Adds a conditional branch of the form, returns its index
+   * (outcome counter of OP_JMP_IF_ELSE, OP_JMP_IF_TRUE)
+   */
+  size_t newBranch(const Exp &exp) {
+    reserveCode(co, co->branches, 1);
+    co->branches.push_back(branchKey(exp));
+    return co->branches.size() - 1;
+  }
+
+  /**
+   * Profiled outcome of the branch test (nullopt if the branch
+   * never ran, or there is no profile)
    */
-  void emit(uint8_t code) { co->code.push_back(code); }
+  std::optional<bool> likelyOutcome(uint64_t key) {
+    auto counts = profile != nullptr ? profile->find(key) : nullptr;
+    if (counts == nullptr || counts->falseCount + counts->trueCount == 0) {
+      return std::nullopt;
+    }
+    return counts->trueCount >= counts->falseCount;
+  }
+
+  /**
+   * Emits a branch of an `if`, an absent one is false
+   */
+  void genBranch(const Exp *exp) {
+    if (exp != nullptr) {
+      gen(*exp);
+    } else {
+      emitConst(booleanConstIdx(false));
+    }
+  }
 
   /**
-   * Write bytes at offset
+   * Emits the deferred cold blocks (including the ones they defer)
    */
-  void writeBytesAtOffset(size_t offset, uint8_t value) {
-    co->code[offset] = value;
+  void genColdBlocks() {
+    for (size_t i = 0; i < coldBlocks.size(); i++) {
+      auto block = coldBlocks[i];
+      patchJumpAddress(block.jumpOffset, getOffset());
+      stack = block.stack;
+      if (block.exp != nullptr) {
+        genChecked(*block.exp);
+      } else {
+        genBranch(nullptr);
+      }
+      emit(OP_JMP, block.endAddr);
+    }
+    coldBlocks.clear();
   }
 
   /**
-   * Patches jump address
+   * Adds a loop with the given header address, returns its
+   * index (back-edge counter of OP_LOOP, OP_FOR_STEP)
    */
-  void patchJumpAddress(size_t offset, uint16_t value) {
-    writeBytesAtOffset(offset, (value >> 8) & 0xFF);
-    writeBytesAtOffset(offset + 1, value & 0xFF);
+  size_t newLoop(size_t header) {
+    reserveCode(co, co->loops, 1);
+    co->loops.push_back(header);
+    return co->loops.size() - 1;
   }
 
   /**
@@ -302,6 +1265,11 @@ private:
    */
   std::shared_ptr<Global> global;
 
+  /**
+   * Operand stack at the code being emitted
+   */
+  StackFrame stack = {0, STACK_LIMIT};
+
   /**
    * Bytecode
    */
@@ -313,15 +1281,91 @@ private:
   CodeObject *co;
 
   /**
-   * Compare ops map
+   * Parameters of the compiling callable (empty at top level)
+   */
+  std::vector<std::string> params;
+
+  /**
+   * Constants are pushed with OP_CONST_WIDE (see emitConst)
+   */
+  bool wideConstants = false;
+
+  /**
+   * Branch profile, and cold blocks of the compiling code object
+   */
+  std::shared_ptr<const BranchProfile> profile;
+  std::vector<ColdBlock> coldBlocks;
+
+  /**
+   * Special form of a list tag (FormType::NONE if it is not one)
    */
-  static std::map<std::string, uint8_t> compareOps_;
+  static const SpecialForm &specialForm(const Exp &tag) {
+    static const SpecialForm none;
+    return tag.symbol < specialForms_.size() ? specialForms_[tag.symbol]
+                                             : none;
+  }
+
+  /**
+   * Special forms by symbol ID
+   */
+  static std::vector<SpecialForm> specialForms_;
 };
 
 /**
- * Compare ops map
+ * Special forms by symbol ID. Interned at startup, so the IDs (and
+ * the table) are small. Compare operand: OP_COMPARE operator, string
+ * operand: OP_STRING builtin.
  */
-std::map<std::string, uint8_t> EvaCompiler::compareOps_ = {
-    {"<", 0}, {">", 1}, {"==", 2}, {">=", 3}, {"<=", 4}, {"!=", 5}};
+template <typename Policy>
+std::vector<SpecialForm> EvaCompiler<Policy>::specialForms_ = [] {
+  std::vector<SpecialForm> forms;
+
+  auto add = [&](const std::string &name, SpecialForm form) {
+    auto id = internSymbol(name);
+    if (id >= forms.size()) {
+      forms.resize(id + 1);
+    }
+    forms[id] = form;
+  };
+
+  add("+", {FormType::ADD});
+  add("-", {FormType::SUB});
+  add("*", {FormType::MUL});
+  add("/", {FormType::DIV});
+
+  add("<", {FormType::COMPARE, 0});
+  add(">", {FormType::COMPARE, 1});
+  add("==", {FormType::COMPARE, 2});
+  add(">=", {FormType::COMPARE, 3});
+  add("<=", {FormType::COMPARE, 4});
+  add("!=", {FormType::COMPARE, 5});
+
+  add("if", {FormType::IF});
+  add("while", {FormType::WHILE});
+  add("map", {FormType::MAP});
+  add("map-get", {FormType::MAP_GET});
+  add("map-has", {FormType::MAP_HAS});
+  add("object", {FormType::OBJECT});
+  add("prop", {FormType::PROP});
+
+  for (uint8_t i = 0; i < STRING_BUILTINS_COUNT; i++) {
+    add(stringBuiltinNames[i], {FormType::STRING, i});
+  }
+
+  // Side effects (not allowed in parallel callables):
+  add("for", {FormType::FOR, 0, true});
+  add("var", {FormType::VAR, 0, true});
+  add("set", {FormType::SET, 0, true});
+  add("map-set", {FormType::MAP_SET, 0, true});
+  add("map-delete", {FormType::MAP_DELETE, 0, true});
+  add("spawn", {FormType::SPAWN, 0, true});
+  add("yield", {FormType::YIELD, 0, true});
+  add("join", {FormType::JOIN, 0, true});
+  add("pmap", {FormType::PMAP, 0, true});
+  add("preduce", {FormType::PREDUCE, 0, true});
+  add("print", {FormType::PRINT, 0, true});
+
+  return forms;
+}();
 
 #endif
@@ -0,0 +1,228 @@
+/**
+ * Eva fibers
+ *
+ * Green threads of one VM: each fiber has its own operand stack and
+ * registers (ip, sp). Fibers switch cooperatively at `yield`, at a
+ * blocking `join`, and when a fiber ends. Scheduling is round-robin.
+ *
+ * A top-level form completes once all fibers it spawned are done.
+ * Fiber ids (the main fiber is 0) are valid for one program, so
+ * results can be joined from later forms.
+ */
+
+#ifndef EVA_FIBER__H
+#define EVA_FIBER__H
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "eva_value.h"
+#include "logger.h"
+
+/**
+ * Operand stack size of the VM (used by the main fiber)
+ */
+#define STACK_LIMIT 512
+
+/**
+ * Operand stack size of a spawned fiber (the main fiber
+ * uses the VM stack)
+ */
+#define FIBER_STACK_SIZE 64
+
+/**
+ * Fiber state
+ */
+enum class FiberState {
+  RUNNABLE,
+  WAITING,
+  DONE,
+};
+
+/**
+ * Fiber: saved registers and own operand stack
+ */
+struct Fiber {
+  /**
+   * Saved instruction and stack pointers
+   */
+  uint8_t *ip;
+  EvaValue *sp;
+
+  /**
+   * Stack bounds
+   */
+  EvaValue *stackBase;
+  EvaValue *stackLimit;
+
+  /**
+   * Own stack (nullptr for the main fiber), released when done
+   */
+  std::unique_ptr<EvaValue[]> stack;
+
+  FiberState state;
+
+  /**
+   * Fibers blocked in `join` on this one
+   */
+  std::vector<size_t> joiners;
+
+  /**
+   * Result, once done
+   */
+  EvaValue result;
+};
+
+/**
+ * Round-robin scheduler of fibers
+ */
+class FiberScheduler {
+public:
+  /**
+   * Starts a program: only the main fiber exists
+   */
+  Fiber *reset(EvaValue *mainStack, size_t size) {
+    for (auto &fiber : fibers) {
+      release(fiber);
+    }
+    fibers.clear();
+    runQueue.clear();
+
+    fibers.push_back({});
+    auto &main = fibers.back();
+    main.stackBase = mainStack;
+    main.stackLimit = mainStack + size;
+    main.sp = mainStack;
+    main.state = FiberState::RUNNABLE;
+
+    current = 0;
+    live = 1;
+    return &main;
+  }
+
+  /**
+   * Creates a runnable fiber starting at ip, returns its id
+   */
+  size_t spawn(uint8_t *ip) {
+    fibers.push_back({});
+    auto &fiber = fibers.back();
+
+    if (freeStacks.empty()) {
+      fiber.stack.reset(new EvaValue[FIBER_STACK_SIZE]);
+    } else {
+      fiber.stack = std::move(freeStacks.back());
+      freeStacks.pop_back();
+    }
+
+    fiber.ip = ip;
+    fiber.stackBase = fiber.stack.get();
+    fiber.stackLimit = fiber.stackBase + FIBER_STACK_SIZE;
+    fiber.sp = fiber.stackBase;
+    fiber.state = FiberState::RUNNABLE;
+
+    auto id = fibers.size() - 1;
+    runQueue.push_back(id);
+    live++;
+    return id;
+  }
+
+  /**
+   * Running fiber
+   */
+  Fiber *running() { return &fibers[current]; }
+
+  /**
+   * Fiber by id
+   */
+  Fiber *get(size_t id) {
+    if (id >= fibers.size()) {
+      DIE << "Unknown fiber: " << id;
+    }
+    return &fibers[id];
+  }
+
+  /**
+   * Blocks the running fiber until the fiber `id` is done
+   */
+  void waitFor(size_t id) {
+    fibers[current].state = FiberState::WAITING;
+    get(id)->joiners.push_back(current);
+  }
+
+  /**
+   * Ends the running fiber, wakes up its joiners
+   */
+  void finish(const EvaValue &result) {
+    auto &fiber = fibers[current];
+    fiber.result = result;
+    fiber.state = FiberState::DONE;
+    release(fiber);
+    live--;
+
+    for (auto id : fiber.joiners) {
+      fibers[id].state = FiberState::RUNNABLE;
+      runQueue.push_back(id);
+    }
+    fiber.joiners.clear();
+  }
+
+  /**
+   * Switches to the next runnable fiber (the running one goes to the
+   * back of the queue, unless blocked or done). Returns nullptr if no
+   * fiber can run (deadlock).
+   */
+  Fiber *next() {
+    if (fibers[current].state == FiberState::RUNNABLE) {
+      runQueue.push_back(current);
+    }
+
+    if (runQueue.empty()) {
+      return nullptr;
+    }
+
+    current = runQueue.front();
+    runQueue.pop_front();
+    return &fibers[current];
+  }
+
+  /**
+   * Whether another fiber is ready to run
+   */
+  bool hasRunnable() const { return !runQueue.empty(); }
+
+  /**
+   * Number of fibers not done yet (including the main one)
+   */
+  size_t liveCount() const { return live; }
+
+private:
+  /**
+   * Returns the fiber's stack to the pool
+   */
+  void release(Fiber &fiber) {
+    if (fiber.stack != nullptr) {
+      freeStacks.push_back(std::move(fiber.stack));
+    }
+  }
+
+  /**
+   * All fibers of the program, by id (deque: stable addresses)
+   */
+  std::deque<Fiber> fibers;
+
+  /**
+   * Ids of runnable fibers, in order
+   */
+  std::deque<size_t> runQueue;
+
+  /**
+   * Stacks of finished fibers, reused by new ones
+   */
+  std::vector<std::unique_ptr<EvaValue[]>> freeStacks;
+
+  size_t current = 0;
+  size_t live = 0;
+};
+
+#endif
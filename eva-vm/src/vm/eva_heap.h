@@ -0,0 +1,375 @@
+/**
+ * Eva heap: per-VM allocation accounting and limits, slab allocator
+ *
+ * All objects are allocated through `allocObject` (from per-thread size
+ * class slabs), which charges the heap of the VM currently running on
+ * this thread (see HeapScope).
+ * Exceeding the heap limit throws HeapLimitError, which aborts the
+ * running script, but leaves the VM (and the process) usable.
+ */
+
+#ifndef EVA_HEAP__H
+#define EVA_HEAP__H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "eva_value.h"
+#include "logger.h"
+
+/**
+ * Error thrown when a VM exceeds its heap limit
+ */
+struct HeapLimitError : public EvaError {
+  HeapLimitError(const std::string &message)
+      : EvaError(message, EvaErrorKind::HEAP_LIMIT) {}
+};
+
+/**
+ * Heap stats, scraped per VM
+ */
+struct HeapStats {
+  size_t limit;
+  size_t liveBytes;
+  size_t peakBytes;
+  size_t limitErrors;
+
+  /**
+   * Live objects and bytes by ObjectType
+   */
+  std::array<size_t, OBJECT_TYPES_COUNT> liveObjects;
+  std::array<size_t, OBJECT_TYPES_COUNT> liveBytesByType;
+};
+
+/**
+ * Heap accounting of one VM. Counters are atomic, since the
+ * parallel compiler allocates constants from worker threads.
+ */
+class EvaHeap {
+public:
+  EvaHeap() {
+    for (auto i = 0; i < OBJECT_TYPES_COUNT; i++) {
+      liveObjects[i] = 0;
+      liveBytesByType[i] = 0;
+    }
+  }
+
+  /**
+   * Hard limit of live bytes (0 is unlimited)
+   */
+  void setLimit(size_t bytes) { limit = bytes; }
+
+  /**
+   * Charges a new object, throws if the limit is exceeded
+   */
+  void onAllocate(Object *object, size_t bytes) {
+    charge(object->type, bytes);
+    object->heapSize = bytes;
+    liveObjects[(int)object->type]++;
+  }
+
+  /**
+   * Releases a freed object
+   */
+  void onFree(Object *object) {
+    liveBytes -= object->heapSize;
+    liveBytesByType[(int)object->type] -= object->heapSize;
+    liveObjects[(int)object->type]--;
+  }
+
+  /**
+   * Charges growth (or shrink) of an object's payload
+   */
+  void onResize(Object *object, size_t newBytes) {
+    if (newBytes > object->heapSize) {
+      charge(object->type, newBytes - object->heapSize);
+    } else {
+      liveBytes -= object->heapSize - newBytes;
+      liveBytesByType[(int)object->type] -= object->heapSize - newBytes;
+    }
+    object->heapSize = newBytes;
+  }
+
+  /**
+   * Returns heap stats
+   */
+  HeapStats stats() const {
+    HeapStats stats{limit, liveBytes, peakBytes, limitErrors, {}, {}};
+    for (auto i = 0; i < OBJECT_TYPES_COUNT; i++) {
+      stats.liveObjects[i] = liveObjects[i];
+      stats.liveBytesByType[i] = liveBytesByType[i];
+    }
+    return stats;
+  }
+
+private:
+  /**
+   * Adds bytes to the live size, checking the limit
+   */
+  void charge(ObjectType type, size_t bytes) {
+    auto live = liveBytes.fetch_add(bytes) + bytes;
+
+    if (limit != 0 && live > limit) {
+      liveBytes -= bytes;
+      limitErrors++;
+      throw HeapLimitError("Heap limit exceeded: " + std::to_string(live) +
+                           " > " + std::to_string(limit) + " bytes");
+    }
+
+    liveBytesByType[(int)type] += bytes;
+
+    auto peak = peakBytes.load();
+    while (live > peak && !peakBytes.compare_exchange_weak(peak, live)) {
+    }
+  }
+
+  size_t limit = 0;
+
+  std::atomic<size_t> liveBytes{0};
+  std::atomic<size_t> peakBytes{0};
+  std::atomic<size_t> limitErrors{0};
+
+  std::array<std::atomic<size_t>, OBJECT_TYPES_COUNT> liveObjects;
+  std::array<std::atomic<size_t>, OBJECT_TYPES_COUNT> liveBytesByType;
+};
+
+/**
+ * Heap of the VM running on this thread (nullptr: not accounted)
+ */
+thread_local EvaHeap *currentHeap = nullptr;
+
+/**
+ * Installs a heap for the current thread, restores the previous one
+ */
+class HeapScope {
+public:
+  HeapScope(EvaHeap *heap) : previous(currentHeap) { currentHeap = heap; }
+  ~HeapScope() { currentHeap = previous; }
+
+private:
+  EvaHeap *previous;
+};
+
+/**
+ * Slab allocator size classes: 16, 32, ..., 256 bytes
+ */
+#define SIZE_CLASS_GRANULE 16
+#define MAX_SMALL_OBJECT 256
+#define SIZE_CLASSES_COUNT (MAX_SMALL_OBJECT / SIZE_CLASS_GRANULE)
+
+/**
+ * Memory carved into blocks of one size class at a time
+ */
+#define SLAB_SIZE (64 * 1024)
+
+/**
+ * Size-class slab allocator for VM objects. Allocation and free are
+ * a freelist pop and push; new blocks are carved from 64K slabs.
+ *
+ * One allocator per thread (no locks). A block freed on another thread
+ * joins that thread's freelist. Slabs are never returned, since objects
+ * may outlive the thread that allocated them.
+ */
+class SlabAllocator {
+public:
+  /**
+   * Size class of an allocation (0: large object, not pooled)
+   */
+  static uint8_t sizeClass(size_t bytes) {
+    return bytes > MAX_SMALL_OBJECT
+               ? 0
+               : (bytes + SIZE_CLASS_GRANULE - 1) / SIZE_CLASS_GRANULE;
+  }
+
+  void *allocate(size_t bytes, uint8_t sizeClass) {
+    if (sizeClass == 0) {
+      return ::operator new(bytes);
+    }
+
+    auto &freeList = freeLists[sizeClass - 1];
+
+    if (freeList != nullptr) {
+      auto block = freeList;
+      freeList = block->next;
+      return block;
+    }
+
+    return carve(sizeClass);
+  }
+
+  void free(void *memory, uint8_t sizeClass) {
+    if (sizeClass == 0) {
+      ::operator delete(memory);
+      return;
+    }
+
+    auto block = (FreeBlock *)memory;
+    block->next = freeLists[sizeClass - 1];
+    freeLists[sizeClass - 1] = block;
+  }
+
+private:
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  /**
+   * Takes a new block from the current slab of the class
+   */
+  void *carve(uint8_t sizeClass) {
+    auto blockSize = sizeClass * SIZE_CLASS_GRANULE;
+    auto &top = slabTop[sizeClass - 1];
+    auto &end = slabEnd[sizeClass - 1];
+
+    if (top == nullptr || top + blockSize > end) {
+      top = (char *)::operator new(SLAB_SIZE);
+      end = top + SLAB_SIZE;
+    }
+
+    auto block = top;
+    top += blockSize;
+    return block;
+  }
+
+  FreeBlock *freeLists[SIZE_CLASSES_COUNT] = {};
+
+  /**
+   * Bump pointers in the current slab of each class
+   */
+  char *slabTop[SIZE_CLASSES_COUNT] = {};
+  char *slabEnd[SIZE_CLASSES_COUNT] = {};
+};
+
+/**
+ * Slab allocator of this thread
+ */
+thread_local SlabAllocator slabAllocator;
+
+/**
+ * Allocates an object of the given size (header and inline payload),
+ * charging the current heap
+ */
+template <typename T, typename... Args>
+T *allocObjectSized(size_t bytes, Args &&...args) {
+  auto sizeClass = SlabAllocator::sizeClass(bytes);
+  auto memory = slabAllocator.allocate(bytes, sizeClass);
+  auto object = new (memory) T(std::forward<Args>(args)...);
+  object->sizeClass = sizeClass;
+
+  if (currentHeap != nullptr) {
+    try {
+      currentHeap->onAllocate(object, object->byteSize());
+    } catch (const HeapLimitError &) {
+      object->~T();
+      slabAllocator.free(memory, sizeClass);
+      throw;
+    }
+  }
+
+  return object;
+}
+
+/**
+ * Allocates an object, charging the current heap
+ */
+template <typename T, typename... Args> T *allocObject(Args &&...args) {
+  return allocObjectSized<T>(sizeof(T), std::forward<Args>(args)...);
+}
+
+/**
+ * Allocates a string with inline characters (optionally concatenated
+ * with a suffix) in one allocation
+ */
+StringObject *allocString(std::string_view str, std::string_view suffix = {}) {
+  auto bytes = sizeof(StringObject) + str.size() + suffix.size() + 1;
+  return allocObjectSized<StringObject>(bytes, str, suffix);
+}
+
+/**
+ * Allocates a slice of a string (a header, no characters)
+ */
+StringObject *allocSlice(StringObject *str, size_t offset, size_t length) {
+  return allocObject<StringObject>(str, offset, length);
+}
+
+/**
+ * Frees an object, releasing it from the current heap
+ */
+template <typename T> void freeObject(T *object) {
+  if (currentHeap != nullptr && object->heapSize != 0) {
+    currentHeap->onFree(object);
+  }
+  auto sizeClass = object->sizeClass;
+  object->~T();
+  slabAllocator.free(object, sizeClass);
+}
+
+/**
+ * Charges payload growth of an object (e.g. map rehash)
+ */
+inline void resizeObject(Object *object, size_t newBytes) {
+  if (currentHeap != nullptr) {
+    currentHeap->onResize(object, newBytes);
+  }
+}
+
+/**
+ * Makes room for `count` more items of a code object vector (code,
+ * constants, ...), charging the growth of its capacity
+ */
+template <typename T>
+void reserveCode(CodeObject *co, std::vector<T> &items, size_t count) {
+  auto size = items.size() + count;
+  if (size <= items.capacity()) {
+    return;
+  }
+  auto capacity = std::max(size, 2 * items.capacity());
+
+  // Charged before the vector grows, so a heap limit error
+  // leaves the code object intact
+  resizeObject(co, co->byteSize() +
+                       (capacity - items.capacity()) * sizeof(T));
+  items.reserve(capacity);
+}
+
+/**
+ * Object type name, used in stats
+ */
+std::string objectTypeToString(ObjectType type) {
+  switch (type) {
+  case ObjectType::STRING:
+    return "STRING";
+  case ObjectType::CODE:
+    return "CODE";
+  case ObjectType::MAP:
+    return "MAP";
+  case ObjectType::INSTANCE:
+    return "INSTANCE";
+  }
+  return "UNKNOWN";
+}
+
+/**
+ * Output stream
+ */
+std::ostream &operator<<(std::ostream &os, const HeapStats &stats) {
+  os << std::dec << "Heap: " << stats.liveBytes << " live bytes, "
+     << stats.peakBytes << " peak, limit " << stats.limit << ", "
+     << stats.limitErrors << " limit errors\n";
+  for (auto i = 0; i < OBJECT_TYPES_COUNT; i++) {
+    os << "  " << objectTypeToString((ObjectType)i) << ": "
+       << stats.liveObjects[i] << " objects, " << stats.liveBytesByType[i]
+       << " bytes\n";
+  }
+  return os;
+}
+
+#endif
@@ -0,0 +1,198 @@
+/**
+ * Eva instances: records with hidden classes (shapes)
+ *
+ * A shape is the layout of an instance: its property names by slot.
+ * Instances which got the same properties in the same order share a
+ * shape, and keep only the values, in a slot array. Adding a property
+ * moves an instance to a child shape (a transition, created once).
+ *
+ * Property instructions cache the slot by shape (PropertyCache), so on
+ * a stable shape an access is a compare and an indexed load. Shapes are
+ * shared by all VMs of the process, and never freed.
+ */
+
+#ifndef EVA_INSTANCE__H
+#define EVA_INSTANCE__H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "eva_heap.h"
+#include "eva_value.h"
+
+/**
+ * Hidden class
+ */
+class Shape {
+public:
+  /**
+   * Shape of new instances (no properties)
+   */
+  static Shape *root() {
+    static Shape *root = new Shape({});
+    return root;
+  }
+
+  /**
+   * Slot of a property, -1 if the shape doesn't have it
+   */
+  int find(uint32_t key) const {
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i] == key) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * Shape with the property added (in the next slot)
+   */
+  Shape *transition(uint32_t key) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto &next = transitions[key];
+    if (next == nullptr) {
+      auto nextKeys = keys;
+      nextKeys.push_back(key);
+      next = new Shape(std::move(nextKeys));
+    }
+    return next;
+  }
+
+  /**
+   * Property names (interned symbol IDs) by slot
+   */
+  const std::vector<uint32_t> &getKeys() const { return keys; }
+
+  size_t slotsCount() const { return keys.size(); }
+
+private:
+  Shape(std::vector<uint32_t> keys) : keys(std::move(keys)) {}
+
+  std::vector<uint32_t> keys;
+
+  /**
+   * Child shapes by added property
+   */
+  std::unordered_map<uint32_t, Shape *> transitions;
+  std::mutex mutex;
+};
+
+/**
+ * Instance object
+ */
+struct InstanceObject : public Object {
+  InstanceObject(size_t capacity = 0)
+      : Object(ObjectType::INSTANCE), shape(Shape::root()) {
+    slots.reserve(capacity);
+  }
+
+  /**
+   * Returns the property value, or nullptr if there is no such property
+   */
+  EvaValue *get(uint32_t key) {
+    auto slot = shape->find(key);
+    return slot == -1 ? nullptr : &slots[slot];
+  }
+
+  /**
+   * Sets a property, adding it if needed
+   */
+  void set(uint32_t key, const EvaValue &value) {
+    auto slot = shape->find(key);
+    if (slot != -1) {
+      slots[slot] = value;
+      return;
+    }
+    addProperty(shape->transition(key), value);
+  }
+
+  /**
+   * Moves to the next shape (one more property), storing its value
+   */
+  void addProperty(Shape *next, const EvaValue &value) {
+    if (slots.size() == slots.capacity()) {
+      auto capacity = slots.empty() ? 4 : 2 * slots.size();
+
+      // Charged before the slots change, so a heap limit error
+      // leaves the instance intact
+      resizeObject(this, sizeof(*this) + capacity * sizeof(EvaValue));
+      slots.reserve(capacity);
+    }
+
+    slots.push_back(value);
+    shape = next;
+  }
+
+  /**
+   * Calls fn(key, value) for each property, in slot order
+   */
+  template <typename Fn> void forEach(Fn fn) const {
+    auto &keys = shape->getKeys();
+    for (size_t i = 0; i < keys.size(); i++) {
+      fn(keys[i], slots[i]);
+    }
+  }
+
+  /**
+   * Allocated size, charged to the heap
+   */
+  size_t byteSize() const {
+    return sizeof(*this) + slots.capacity() * sizeof(EvaValue);
+  }
+
+  Shape *shape;
+
+  /**
+   * Property values, laid out by the shape
+   */
+  std::vector<EvaValue> slots;
+};
+
+/**
+ * Entry being filled (not matched by any shape)
+ */
+#define CACHE_ENTRY_FILLING ((Shape *)1)
+
+/**
+ * Cache entry of the shape, nullptr on a miss
+ */
+inline const PropertyCacheEntry *probeCache(const PropertyCache &cache,
+                                            const Shape *shape) {
+  for (auto &entry : cache.entries) {
+    auto cached = entry.shape.load(std::memory_order_acquire);
+    if (cached == shape) {
+      return &entry;
+    }
+    if (cached == nullptr) {
+      break;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Adds an entry for the shape, if one is free (otherwise the site
+ * is megamorphic, and keeps looking up the shape)
+ */
+inline void fillCache(PropertyCache &cache, Shape *shape, uint32_t slot,
+                      Shape *transition = nullptr) {
+  for (auto &entry : cache.entries) {
+    Shape *expected = nullptr;
+    if (entry.shape.compare_exchange_strong(expected, CACHE_ENTRY_FILLING)) {
+      entry.slot = slot;
+      entry.transition = transition;
+      entry.shape.store(shape, std::memory_order_release);
+      return;
+    }
+    if (expected == shape) {
+      return;
+    }
+  }
+}
+
+#endif
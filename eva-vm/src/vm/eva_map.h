@@ -0,0 +1,496 @@
+/**
+ * Eva map: open-addressing hash table (SwissTable layout)
+ *
+ * Slots are split into groups of 16. Each slot has a control byte:
+ * empty, deleted (tombstone), or the low 7 bits of the key hash (H2).
+ * Lookup loads a whole group of control bytes and matches H2 against
+ * all of them at once (SSE2 when available), touching the slots only
+ * on a control byte hit.
+ */
+
+#ifndef EVA_MAP__H
+#define EVA_MAP__H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "eva_heap.h"
+#include "eva_value.h"
+
+/**
+ * Control bytes
+ */
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+#define IS_CTRL_FULL(ctrl) ((ctrl) >= 0)
+
+/**
+ * Number of control bytes matched at once
+ */
+#define MAP_GROUP_WIDTH 16
+
+/**
+ * Max load factor (7/8, as in SwissTable)
+ */
+#define MAP_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+/**
+ * Mixes hash bits, so H1/H2 are well distributed for any input
+ */
+inline size_t mixHash(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return (size_t)x;
+}
+
+/**
+ * Whether a double holds an exact int64 value
+ */
+inline bool isInt64Double(double number) {
+  return number >= -9223372036854775808.0 && number < 9223372036854775808.0 &&
+         number == (double)(int64_t)number;
+}
+
+/**
+ * Hash of a map key
+ */
+size_t hashEvaValue(const EvaValue &value) {
+  switch (value.type) {
+  case EvaValueType::INT:
+    return mixHash((uint64_t)value.integer);
+  case EvaValueType::NUMBER: {
+    // Integral doubles hash as ints, so 1 and 1.0 are the same key
+    if (isInt64Double(value.number)) {
+      return mixHash((uint64_t)(int64_t)value.number);
+    }
+    double number = value.number;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return mixHash(bits);
+  }
+  case EvaValueType::BOOLEAN:
+    return mixHash(value.boolean ? 1 : 2);
+  case EvaValueType::OBJECT:
+    // Strings reuse their cached hash
+    if (IS_STRING(value)) {
+      return mixHash(AS_STRING(value)->hash());
+    }
+    return mixHash((uint64_t)(uintptr_t)value.object);
+  }
+
+  return 0; // Unreachable
+}
+
+/**
+ * Equality of map keys: strings by content, other objects by identity
+ */
+bool evaValueKeyEquals(const EvaValue &a, const EvaValue &b) {
+  // Mixed int/double: equal only if the double is exactly that int
+  if (IS_NUMERIC(a) && IS_NUMERIC(b) && a.type != b.type) {
+    auto integer = IS_INT(a) ? AS_INT(a) : AS_INT(b);
+    auto number = IS_INT(a) ? AS_NUMBER(b) : AS_NUMBER(a);
+    return isInt64Double(number) && (int64_t)number == integer;
+  }
+
+  if (a.type != b.type) {
+    return false;
+  }
+
+  switch (a.type) {
+  case EvaValueType::NUMBER:
+    return a.number == b.number;
+  case EvaValueType::INT:
+    return a.integer == b.integer;
+  case EvaValueType::BOOLEAN:
+    return a.boolean == b.boolean;
+  case EvaValueType::OBJECT:
+    if (a.object == b.object) {
+      return true;
+    }
+    if (IS_STRING(a) && IS_STRING(b)) {
+      return AS_STRING(a)->hash() == AS_STRING(b)->hash() &&
+             AS_CPPSTRING(a) == AS_CPPSTRING(b);
+    }
+    return false;
+  }
+
+  return false; // Unreachable
+}
+
+/**
+ * Bitmask of slots in a group, bit i corresponds to slot i
+ */
+struct GroupMask {
+  uint32_t mask;
+
+  explicit operator bool() const { return mask != 0; }
+
+  /**
+   * Index of the lowest set slot
+   */
+  uint32_t lowest() const { return __builtin_ctz(mask); }
+
+  /**
+   * Clears the lowest set slot
+   */
+  void next() { mask &= mask - 1; }
+};
+
+/**
+ * Group of control bytes starting at a position
+ */
+struct Group {
+#if defined(__SSE2__)
+  explicit Group(const int8_t *pos)
+      : ctrl(_mm_loadu_si128((const __m128i *)pos)) {}
+
+  /**
+   * Slots with the given H2
+   */
+  GroupMask match(int8_t h2) const {
+    auto eq = _mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl);
+    return {(uint32_t)_mm_movemask_epi8(eq)};
+  }
+
+  /**
+   * Empty slots
+   */
+  GroupMask matchEmpty() const { return match(CTRL_EMPTY); }
+
+  /**
+   * Empty or deleted slots (both are < -1)
+   */
+  GroupMask matchEmptyOrDeleted() const {
+    auto lt = _mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl);
+    return {(uint32_t)_mm_movemask_epi8(lt)};
+  }
+
+  __m128i ctrl;
+#else
+  explicit Group(const int8_t *pos) { memcpy(ctrl, pos, MAP_GROUP_WIDTH); }
+
+  GroupMask match(int8_t h2) const {
+    uint32_t mask = 0;
+    for (auto i = 0; i < MAP_GROUP_WIDTH; i++) {
+      mask |= (uint32_t)(ctrl[i] == h2) << i;
+    }
+    return {mask};
+  }
+
+  GroupMask matchEmpty() const { return match(CTRL_EMPTY); }
+
+  GroupMask matchEmptyOrDeleted() const {
+    uint32_t mask = 0;
+    for (auto i = 0; i < MAP_GROUP_WIDTH; i++) {
+      mask |= (uint32_t)(ctrl[i] < -1) << i;
+    }
+    return {mask};
+  }
+
+  int8_t ctrl[MAP_GROUP_WIDTH];
+#endif
+};
+
+/**
+ * Map entry
+ */
+struct MapEntry {
+  EvaValue key;
+  EvaValue value;
+};
+
+/**
+ * Map stats, exposed for tuning
+ */
+struct MapStats {
+  size_t size;
+  size_t capacity;
+  size_t tombstones;
+  double loadFactor;
+
+  /**
+   * Number of lookups (get/set/has/delete)
+   */
+  size_t lookups;
+
+  /**
+   * Total and max number of groups probed per lookup
+   */
+  size_t totalProbes;
+  size_t maxProbeLength;
+
+  double averageProbeLength() const {
+    return lookups == 0 ? 0 : (double)totalProbes / lookups;
+  }
+};
+
+/**
+ * Map object
+ */
+struct MapObject : public Object {
+  MapObject() : Object(ObjectType::MAP) {}
+
+  /**
+   * Returns the value by key, or nullptr if the key is absent
+   */
+  EvaValue *get(const EvaValue &key) {
+    auto index = find(key, hashEvaValue(key));
+    return index == -1 ? nullptr : &slots[index].value;
+  }
+
+  /**
+   * Whether the key exists
+   */
+  bool has(const EvaValue &key) { return get(key) != nullptr; }
+
+  /**
+   * Sets the value by key
+   */
+  void set(const EvaValue &key, const EvaValue &value) {
+    auto hash = hashEvaValue(key);
+    auto index = find(key, hash);
+
+    if (index != -1) {
+      slots[index].value = value;
+      return;
+    }
+
+    if (size + tombstones + 1 > MAP_MAX_LOAD(capacity)) {
+      // Many tombstones: rehash in place, otherwise grow
+      rehash(size + 1 <= MAP_MAX_LOAD(capacity) / 2 ? capacity
+                                                    : growCapacity());
+    }
+
+    index = findInsertSlot(hash);
+
+    if (ctrl[index] == CTRL_DELETED) {
+      tombstones--;
+    }
+
+    setCtrl(index, H2(hash));
+    slots[index] = {key, value};
+    size++;
+  }
+
+  /**
+   * Removes the key, returns whether it existed
+   */
+  bool remove(const EvaValue &key) {
+    auto index = find(key, hashEvaValue(key));
+
+    if (index == -1) {
+      return false;
+    }
+
+    setCtrl(index, CTRL_DELETED);
+    size--;
+    tombstones++;
+    return true;
+  }
+
+  /**
+   * Number of entries
+   */
+  size_t count() const { return size; }
+
+  /**
+   * Allocated size, charged to the heap
+   */
+  size_t byteSize() const { return tableBytes(capacity); }
+
+  /**
+   * Calls fn(key, value) for each entry
+   */
+  template <typename Fn> void forEach(Fn fn) const {
+    for (size_t i = 0; i < capacity; i++) {
+      if (IS_CTRL_FULL(ctrl[i])) {
+        fn(slots[i].key, slots[i].value);
+      }
+    }
+  }
+
+  /**
+   * Current load factor (including tombstones)
+   */
+  double loadFactor() const {
+    return capacity == 0 ? 0 : (double)(size + tombstones) / capacity;
+  }
+
+  /**
+   * Returns table stats
+   */
+  MapStats stats() const {
+    return {size,
+            capacity,
+            tombstones,
+            loadFactor(),
+            lookups.load(std::memory_order_relaxed),
+            totalProbes.load(std::memory_order_relaxed),
+            maxProbeLength.load(std::memory_order_relaxed)};
+  }
+
+private:
+  /**
+   * H1: probe start, H2: control byte
+   */
+  static size_t H1(size_t hash) { return hash >> 7; }
+  static int8_t H2(size_t hash) { return (int8_t)(hash & 0x7F); }
+
+  /**
+   * Finds slot index of the key, -1 if absent
+   */
+  int64_t find(const EvaValue &key, size_t hash) {
+    if (!frozen) {
+      lookups.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (capacity == 0) {
+      return -1;
+    }
+
+    auto mask = capacity - 1;
+    auto pos = H1(hash) & mask;
+    auto h2 = H2(hash);
+
+    for (size_t probe = 1;; probe++) {
+      Group group(&ctrl[pos]);
+
+      for (auto match = group.match(h2); match; match.next()) {
+        auto index = (pos + match.lowest()) & mask;
+        if (evaValueKeyEquals(slots[index].key, key)) {
+          recordProbe(probe);
+          return index;
+        }
+      }
+
+      if (group.matchEmpty() || probe * MAP_GROUP_WIDTH >= capacity) {
+        recordProbe(probe);
+        return -1;
+      }
+
+      // Triangular probing over groups visits every group
+      pos = (pos + probe * MAP_GROUP_WIDTH) & mask;
+    }
+  }
+
+  /**
+   * Finds first empty or deleted slot in the probe sequence
+   */
+  size_t findInsertSlot(size_t hash) {
+    auto mask = capacity - 1;
+    auto pos = H1(hash) & mask;
+
+    for (size_t probe = 1;; probe++) {
+      Group group(&ctrl[pos]);
+      if (auto match = group.matchEmptyOrDeleted()) {
+        return (pos + match.lowest()) & mask;
+      }
+      pos = (pos + probe * MAP_GROUP_WIDTH) & mask;
+    }
+  }
+
+  /**
+   * Sets control byte, mirroring the first group after the end,
+   * so a group load never wraps around
+   */
+  void setCtrl(size_t index, int8_t value) {
+    ctrl[index] = value;
+    if (index < MAP_GROUP_WIDTH) {
+      ctrl[capacity + index] = value;
+    }
+  }
+
+  /**
+   * Next capacity (always a power of two, at least one group)
+   */
+  size_t growCapacity() {
+    return capacity == 0 ? MAP_GROUP_WIDTH : capacity * 2;
+  }
+
+  /**
+   * Reallocates the table, dropping tombstones
+   */
+  void rehash(size_t newCapacity) {
+    // Charged before the table changes, so a heap limit error
+    // leaves the map intact
+    resizeObject(this, tableBytes(newCapacity));
+
+    auto oldCtrl = std::move(ctrl);
+    auto oldSlots = std::move(slots);
+    auto oldCapacity = capacity;
+
+    capacity = newCapacity;
+    ctrl.assign(capacity + MAP_GROUP_WIDTH, CTRL_EMPTY);
+    slots.assign(capacity, {});
+    tombstones = 0;
+
+    for (size_t i = 0; i < oldCapacity; i++) {
+      if (!IS_CTRL_FULL(oldCtrl[i])) {
+        continue;
+      }
+      auto hash = hashEvaValue(oldSlots[i].key);
+      auto index = findInsertSlot(hash);
+      setCtrl(index, H2(hash));
+      slots[index] = oldSlots[i];
+    }
+  }
+
+  /**
+   * Object and table size for a capacity
+   */
+  static size_t tableBytes(size_t capacity) {
+    return sizeof(MapObject) +
+           (capacity == 0 ? 0
+                          : capacity + MAP_GROUP_WIDTH +
+                                capacity * sizeof(MapEntry));
+  }
+
+  /**
+   * Records probe length of a lookup (not for frozen maps, which
+   * are read by many threads). A non-frozen map can still be read by
+   * pmap workers, so the counters are relaxed atomics.
+   */
+  void recordProbe(size_t probe) {
+    if (frozen) {
+      return;
+    }
+    totalProbes.fetch_add(probe, std::memory_order_relaxed);
+    auto max = maxProbeLength.load(std::memory_order_relaxed);
+    while (probe > max && !maxProbeLength.compare_exchange_weak(
+                              max, probe, std::memory_order_relaxed)) {
+    }
+  }
+
+  /**
+   * Control bytes (capacity + mirrored first group)
+   */
+  std::vector<int8_t> ctrl;
+
+  /**
+   * Entries
+   */
+  std::vector<MapEntry> slots;
+
+  size_t capacity = 0;
+  size_t size = 0;
+  size_t tombstones = 0;
+
+  /**
+   * Probe stats
+   */
+  std::atomic<size_t> lookups{0};
+  std::atomic<size_t> totalProbes{0};
+  std::atomic<size_t> maxProbeLength{0};
+};
+
+#endif
@@ -0,0 +1,271 @@
+/**
+ * Eva output: buffered `print`
+ *
+ * print formats into a ring buffer, and a writer thread drains it to the
+ * output file descriptor with writev (a wrapped buffer is one call), so
+ * the interpreter loop doesn't wait for I/O. The writer batches: it
+ * drains once OUTPUT_BATCH bytes are buffered, or OUTPUT_LATENCY_MS
+ * after the first byte. A full buffer makes print wait (backpressure).
+ * The VM flushes when a run returns, so its output is written by then.
+ *
+ * One producer (the VM thread) and one consumer (the writer): the
+ * buffer positions are atomics, the lock is only taken to sleep and
+ * to wake the other side up.
+ */
+
+#ifndef EVA_OUTPUT__H
+#define EVA_OUTPUT__H
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+/**
+ * Ring buffer size (a power of 2), allocated on the first print
+ */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+/**
+ * Buffered bytes that wake the writer up
+ */
+#define OUTPUT_BATCH (64 * 1024)
+
+/**
+ * Longest time a smaller batch waits to be written
+ */
+#define OUTPUT_LATENCY_MS 10
+
+/**
+ * Output stats, scraped per VM
+ */
+struct OutputStats {
+  size_t bytes;
+
+  /**
+   * writev calls
+   */
+  size_t writes;
+
+  /**
+   * Prints which waited for room in a full buffer
+   */
+  size_t stalls;
+};
+
+class EvaOutput {
+public:
+  explicit EvaOutput(int fd = STDOUT_FILENO) : fd(fd) {}
+
+  ~EvaOutput() {
+    if (!writer.joinable()) {
+      return;
+    }
+    flush();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    writerWake.notify_one();
+    writer.join();
+  }
+
+  /**
+   * Appends to the buffer, waits while it's full
+   */
+  void write(std::string_view data) {
+    if (!writer.joinable()) {
+      start();
+    }
+
+    // Earlier output of the process to the same stream goes first
+    if (!active) {
+      if (fd == STDOUT_FILENO) {
+        std::cout.flush();
+      }
+      active = true;
+    }
+
+    while (!data.empty()) {
+      auto position = head.load(std::memory_order_relaxed);
+      auto room = OUTPUT_BUFFER_SIZE - (position - tail.load());
+      if (room == 0) {
+        stalls++;
+        waitForTail(position - OUTPUT_BUFFER_SIZE + 1);
+        continue;
+      }
+
+      auto size = std::min(room, data.size());
+      auto at = position & (OUTPUT_BUFFER_SIZE - 1);
+      auto first = std::min(size, OUTPUT_BUFFER_SIZE - at);
+      memcpy(&buffer[at], data.data(), first);
+      memcpy(&buffer[0], data.data() + first, size - first);
+      data.remove_prefix(size);
+
+      head.store(position + size);
+      bytes += size;
+
+      // The writer sleeps until the first byte, then until a batch
+      auto state = writerState.load();
+      if (state == WriterState::IDLE ||
+          (state == WriterState::BATCHING &&
+           position + size - tail.load() >= OUTPUT_BATCH)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        writerWake.notify_one();
+      }
+    }
+  }
+
+  /**
+   * Waits until the buffer is written. Returns the errno of a failed
+   * write since the last flush (the failed output is dropped), or 0.
+   */
+  int flush() {
+    if (!active) {
+      return 0;
+    }
+    waitForTail(head.load(std::memory_order_relaxed));
+    active = false;
+    return error.exchange(0);
+  }
+
+  /**
+   * Sets the file descriptor (after writing the buffer to the previous)
+   */
+  int setFd(int newFd) {
+    auto result = flush();
+    fd = newFd;
+    return result;
+  }
+
+  OutputStats stats() const { return {bytes, writes, stalls}; }
+
+private:
+  enum class WriterState { BUSY, IDLE, BATCHING };
+
+  void start() {
+    buffer = std::make_unique<char[]>(OUTPUT_BUFFER_SIZE);
+    writer = std::thread([this]() { run(); });
+  }
+
+  /**
+   * Writer thread
+   */
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      auto pending = [&]() { return head.load() - tail.load(); };
+
+      if (pending() == 0) {
+        if (stop) {
+          return;
+        }
+        writerState = WriterState::IDLE;
+        writerWake.wait(lock, [&]() { return pending() != 0 || stop; });
+        continue;
+      }
+
+      if (pending() < OUTPUT_BATCH && !flushing && !stop) {
+        writerState = WriterState::BATCHING;
+        writerWake.wait_for(
+            lock, std::chrono::milliseconds(OUTPUT_LATENCY_MS), [&]() {
+              return pending() >= OUTPUT_BATCH || flushing || stop;
+            });
+      }
+      writerState = WriterState::BUSY;
+
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+  }
+
+  /**
+   * Writes the buffered bytes
+   */
+  void drain() {
+    auto position = tail.load(std::memory_order_relaxed);
+    auto end = head.load();
+
+    while (position != end) {
+      auto at = position & (OUTPUT_BUFFER_SIZE - 1);
+      auto size = end - position;
+      auto first = std::min(size, OUTPUT_BUFFER_SIZE - at);
+
+      iovec parts[2] = {{&buffer[at], first}, {&buffer[0], size - first}};
+      auto written = ::writev(fd, parts, first == size ? 1 : 2);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      writes++;
+      if (written < 0) {
+        error = errno;
+        written = size;
+      }
+
+      position += written;
+      tail.store(position);
+
+      if (flushing.load()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        printerWake.notify_one();
+      }
+    }
+  }
+
+  /**
+   * Waits until the writer reaches the position (and hurries it)
+   */
+  void waitForTail(size_t position) {
+    std::unique_lock<std::mutex> lock(mutex);
+    flushing = true;
+    writerWake.notify_one();
+    printerWake.wait(lock, [&]() { return tail.load() >= position; });
+    flushing = false;
+  }
+
+  /**
+   * Output file descriptor (changed only when the buffer is empty)
+   */
+  int fd;
+
+  std::unique_ptr<char[]> buffer;
+
+  /**
+   * Positions of the next byte to print and to write: only the VM
+   * moves the head, only the writer moves the tail
+   */
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+
+  /**
+   * Printed since the last flush
+   */
+  bool active = false;
+
+  std::thread writer;
+  std::mutex mutex;
+  std::condition_variable writerWake;
+  std::condition_variable printerWake;
+  std::atomic<WriterState> writerState{WriterState::BUSY};
+  std::atomic<bool> flushing{false};
+  bool stop = false;
+
+  std::atomic<int> error{0};
+
+  size_t bytes = 0;
+  std::atomic<size_t> writes{0};
+  size_t stalls = 0;
+};
+
+#endif
@@ -0,0 +1,320 @@
+/**
+ * Eva parallel compiler
+ *
+ * Compiles independent top-level forms on a thread pool:
+ *
+ *   1. Sequential pre-pass resolves globals (so `Global` is read-only
+ *      afterwards)
+ *   2. Each form is compiled into its own code unit in parallel
+ *   3. Units are linked into one code object: constant pools are merged,
+ *      jump addresses (and loop, branch, cache indices) relocated
+ */
+
+#ifndef EVA_PARALLEL_COMPILER__H
+#define EVA_PARALLEL_COMPILER__H
+
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../bytecode/op_code.h"
+#include "../parser/eva_parser.h"
+#include "eva_compiler.h"
+#include "eva_heap.h"
+#include "eva_map.h"
+#include "eva_profile.h"
+#include "eva_value.h"
+#include "global.h"
+
+/**
+ * Parallel compiler and linker of top-level forms
+ */
+class EvaParallelCompiler {
+public:
+  EvaParallelCompiler(std::shared_ptr<Global> global,
+                      std::shared_ptr<const BranchProfile> profile = nullptr)
+      : global(global), profile(profile) {}
+
+  /**
+   * Compiles forms, and links them into one code object. The forms
+   * are evaluated in order, the last one is the program result.
+   */
+  CodeObject *compile(const std::vector<Exp> &forms, size_t threads = 0) {
+    // 1. Resolve globals sequentially
+    EvaCompiler resolver(global);
+    for (const auto &form : forms) {
+      resolver.resolveGlobals(form);
+    }
+
+    // 2. Compile units in parallel
+    std::vector<CodeObject *> units(forms.size());
+    compileUnits(forms, units, threads);
+
+    // 3. Link (operands out of range are compile errors)
+    try {
+      return link(units);
+    } catch (EvaError &error) {
+      error.kind = EvaErrorKind::COMPILE;
+      throw;
+    }
+  }
+
+private:
+  /**
+   * Compiles each form into its own unit on a pool of threads
+   */
+  void compileUnits(const std::vector<Exp> &forms,
+                    std::vector<CodeObject *> &units, size_t threads) {
+    if (threads == 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, forms.size());
+
+    // Forms are taken dynamically, since their sizes vary a lot
+    std::atomic<size_t> nextForm{0};
+
+    // Workers charge the heap of the calling VM
+    auto heap = currentHeap;
+
+    // First error (of the earliest form), rethrown on the calling thread
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    size_t errorForm = forms.size();
+
+    auto worker = [&]() {
+      HeapScope heapScope(heap);
+      EvaCompiler compiler(global);
+      compiler.setProfile(profile);
+      for (;;) {
+        auto i = nextForm.fetch_add(1, std::memory_order_relaxed);
+        if (i >= forms.size()) {
+          break;
+        }
+        try {
+          units[i] = compiler.compileUnit(forms[i]);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(errorMutex);
+          if (i < errorForm) {
+            error = std::current_exception();
+            errorForm = i;
+          }
+        }
+      }
+    };
+
+    if (threads <= 1) {
+      worker();
+    } else {
+      std::vector<std::thread> pool;
+      for (size_t i = 0; i < threads; i++) {
+        pool.emplace_back(worker);
+      }
+      for (auto &thread : pool) {
+        thread.join();
+      }
+    }
+
+    if (error != nullptr) {
+      for (auto unit : units) {
+        if (unit != nullptr) {
+          freeObject(unit);
+        }
+      }
+      std::rethrow_exception(error);
+    }
+  }
+
+  /**
+   * Links units into one code object:
+   *
+   *   <unit 1> OP_POP <unit 2> OP_POP ... <unit N> OP_HALT
+   */
+  CodeObject *link(const std::vector<CodeObject *> &units) {
+    co = AS_CODE(ALLOC_CODE("main"));
+    constIndices.clear();
+
+    for (size_t i = 0; i < units.size(); i++) {
+      // Discard result of the previous form
+      if (i > 0) {
+        reserveCode(co, co->code, opcodeSize(OP_POP));
+        emitInstruction(co->code, OP_POP);
+      }
+      linkUnit(units[i]);
+      freeObject(units[i]);
+    }
+
+    // Empty program evaluates to false
+    if (units.empty()) {
+      reserveCode(co, co->code, opcodeSize(OP_CONST));
+      emitInstruction(co->code, OP_CONST, {linkConstIdx(BOOLEAN(false))});
+      co->maxStack = 1;
+    }
+
+    reserveCode(co, co->code, opcodeSize(OP_HALT));
+    emitInstruction(co->code, OP_HALT);
+
+    return co;
+  }
+
+  /**
+   * Appends a unit, remapping constants and relocating jumps
+   */
+  void linkUnit(CodeObject *unit) {
+    auto offsetBase = co->code.size();
+    auto base = offsetBase / CODE_UNIT;
+    auto loopBase = co->loops.size();
+    auto branchBase = co->branches.size();
+    auto cacheBase = co->propertyCaches.size();
+    auto &code = unit->code;
+
+    reserveCode(co, co->loops, unit->loops.size());
+    reserveCode(co, co->branches, unit->branches.size());
+    reserveCode(co, co->propertyCaches, unit->propertyCaches.size());
+    reserveCode(co, co->code, code.size());
+
+    // Each unit starts on an empty stack (the previous result is popped)
+    co->maxStack = std::max(co->maxStack, unit->maxStack);
+
+    for (auto header : unit->loops) {
+      co->loops.push_back(header + base);
+    }
+
+    co->branches.insert(co->branches.end(), unit->branches.begin(),
+                        unit->branches.end());
+
+    co->propertyCaches.insert(co->propertyCaches.end(),
+                              unit->propertyCaches.begin(),
+                              unit->propertyCaches.end());
+
+    size_t offset = 0;
+    while (offset < code.size()) {
+      auto opcode = code[offset];
+      auto size = opcodeSize(opcode);
+
+      co->code.insert(co->code.end(), code.begin() + offset,
+                      code.begin() + offset + size);
+
+      auto linked = offsetBase + offset;
+
+      switch (opcode) {
+      case OP_CONST:
+      case OP_CONST_WIDE:
+        setOperand(co->code, linked, 0,
+                   linkConstIdx(unit->constants[getOperand(code, offset, 0)]));
+        break;
+
+      case OP_JMP:
+      case OP_SPAWN:
+        relocate(linked, 0, base);
+        break;
+
+      case OP_JMP_IF_ELSE:
+      case OP_JMP_IF_TRUE:
+        relocate(linked, 0, base);
+        relocate(linked, 1, branchBase);
+        break;
+
+      case OP_LOOP:
+        relocate(linked, 0, base);
+        relocate(linked, 1, loopBase);
+        break;
+
+      case OP_FOR_STEP:
+        relocate(linked, 1, base);
+        relocate(linked, 2, loopBase);
+        break;
+
+      case OP_GET_PROP:
+      case OP_SET_PROP:
+      case OP_INIT_PROP:
+        relocate(linked, 0, cacheBase);
+        break;
+      }
+
+      offset += size;
+    }
+  }
+
+  /**
+   * Adds base to operand i of the linked instruction at offset
+   */
+  void relocate(size_t offset, size_t i, size_t base) {
+    setOperand(co->code, offset, i, getOperand(co->code, offset, i) + base);
+  }
+
+  /**
+   * Index of the constant in the merged pool (deduplicated
+   * by exact representation)
+   */
+  size_t linkConstIdx(const EvaValue &value) {
+    auto it = constIndices.find(value);
+    if (it != constIndices.end()) {
+      return it->second;
+    }
+
+    reserveCode(co, co->constants, 1);
+    co->constants.push_back(value);
+    constIndices.emplace(value, co->constants.size() - 1);
+    return co->constants.size() - 1;
+  }
+
+  /**
+   * Whether two constants are interchangeable
+   */
+  static bool isSameConst(const EvaValue &a, const EvaValue &b) {
+    if (a.type != b.type) {
+      return false;
+    }
+    if (IS_NUMBER(a)) {
+      return memcmp(&a.number, &b.number, sizeof(a.number)) == 0;
+    }
+    if (IS_INT(a)) {
+      return AS_INT(a) == AS_INT(b);
+    }
+    if (IS_BOOLEAN(a)) {
+      return AS_BOOLEAN(a) == AS_BOOLEAN(b);
+    }
+    if (IS_STRING(a) && IS_STRING(b)) {
+      return AS_CPPSTRING(a) == AS_CPPSTRING(b);
+    }
+    return AS_OBJECT(a) == AS_OBJECT(b);
+  }
+
+  /**
+   * Constants hashed as map keys (equal constants are equal keys)
+   */
+  struct ConstHash {
+    size_t operator()(const EvaValue &value) const {
+      return hashEvaValue(value);
+    }
+  };
+
+  struct ConstEqual {
+    bool operator()(const EvaValue &a, const EvaValue &b) const {
+      return isSameConst(a, b);
+    }
+  };
+
+  /**
+   * Global object
+   */
+  std::shared_ptr<Global> global;
+
+  /**
+   * Branch profile of the unit compilers (nullptr: none)
+   */
+  std::shared_ptr<const BranchProfile> profile;
+
+  /**
+   * Linked code object, and indices of its constants
+   */
+  CodeObject *co;
+  std::unordered_map<EvaValue, size_t, ConstHash, ConstEqual> constIndices;
+};
+
+#endif
@@ -0,0 +1,64 @@
+/**
+ * Eva build policies
+ *
+ * Compile-time configuration of the VM and the compiler (EvaVM<Policy>,
+ * EvaCompiler<Policy>). What a policy turns off is removed with
+ * `if constexpr`, so it costs nothing in the interpreter loop.
+ */
+
+#ifndef EVA_POLICY__H
+#define EVA_POLICY__H
+
+/**
+ * Checks, tracing, and counters
+ */
+struct DebugPolicy {
+  /**
+   * Stack overflow and underflow checks in push, pop, peek
+   */
+  static constexpr bool checkStack = true;
+
+  /**
+   * Unknown opcodes are errors
+   */
+  static constexpr bool checkOpcodes = true;
+
+  /**
+   * Disassembly of compiled programs (see setDisassemble)
+   */
+  static constexpr bool disassemble = true;
+
+  /**
+   * Instruction trace to stderr (see setTrace)
+   */
+  static constexpr bool trace = true;
+
+  /**
+   * Back-edge, branch and jump counters (hot loops, branch profiles)
+   */
+  static constexpr bool profile = true;
+};
+
+/**
+ * Trusts the bytecode: a stack overflow or a bad opcode is undefined
+ * behavior. Branch profiles are recorded by debug builds, and used by
+ * both.
+ */
+struct ReleasePolicy {
+  static constexpr bool checkStack = false;
+  static constexpr bool checkOpcodes = false;
+  static constexpr bool disassemble = false;
+  static constexpr bool trace = false;
+  static constexpr bool profile = false;
+};
+
+/**
+ * Policy of EvaVM<> (release builds define NDEBUG)
+ */
+#ifdef NDEBUG
+using DefaultPolicy = ReleasePolicy;
+#else
+using DefaultPolicy = DebugPolicy;
+#endif
+
+#endif
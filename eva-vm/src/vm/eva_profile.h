@@ -0,0 +1,147 @@
+/**
+ * Eva branch profile
+ *
+ * The VM counts the outcomes of each conditional branch. A profile
+ * sums them by branch key: a hash of the branching form, so it matches
+ * the same source across runs, however the code was laid out.
+ *
+ * Text file format:
+ *
+ *   eva-profile 1
+ *   <key (hex)> <false count> <true count>
+ *   ...
+ */
+
+#ifndef EVA_PROFILE__H
+#define EVA_PROFILE__H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+
+#include "../parser/eva_parser.h"
+#include "logger.h"
+
+#define PROFILE_MAGIC "eva-profile"
+#define PROFILE_VERSION 1
+
+#define FNV_OFFSET_BASIS 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+/**
+ * FNV-1a over the form (symbol names, not interned IDs, which
+ * differ between runs)
+ */
+inline uint64_t hashExp(const Exp &exp, uint64_t hash = FNV_OFFSET_BASIS) {
+  auto mix = [&](const void *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ ((const uint8_t *)data)[i]) * FNV_PRIME;
+    }
+  };
+
+  auto type = (uint8_t)exp.type;
+  mix(&type, sizeof(type));
+
+  switch (exp.type) {
+  case ExpType::NUMBER:
+    mix(&exp.number, sizeof(exp.number));
+    break;
+  case ExpType::INT:
+    mix(&exp.integer, sizeof(exp.integer));
+    break;
+  case ExpType::STRING:
+  case ExpType::SYMBOL: {
+    auto size = exp.string.size();
+    mix(&size, sizeof(size));
+    mix(exp.string.data(), size);
+  } break;
+  case ExpType::LIST: {
+    auto size = exp.list.size();
+    mix(&size, sizeof(size));
+    for (auto &item : exp.list) {
+      hash = hashExp(item, hash);
+    }
+  } break;
+  }
+
+  return hash;
+}
+
+/**
+ * Profile key of a branching form (identical forms share a key)
+ */
+inline uint64_t branchKey(const Exp &exp) { return hashExp(exp); }
+
+/**
+ * Outcomes of a branch test
+ */
+struct BranchCounts {
+  uint64_t falseCount = 0;
+  uint64_t trueCount = 0;
+};
+
+/**
+ * Branch outcomes by key
+ */
+class BranchProfile {
+public:
+  void add(uint64_t key, uint64_t falseCount, uint64_t trueCount) {
+    auto &counts = branches[key];
+    counts.falseCount += falseCount;
+    counts.trueCount += trueCount;
+  }
+
+  /**
+   * Counts of the branch, nullptr if it never ran
+   */
+  const BranchCounts *find(uint64_t key) const {
+    auto it = branches.find(key);
+    return it == branches.end() ? nullptr : &it->second;
+  }
+
+  size_t size() const { return branches.size(); }
+
+  void save(const std::string &path) const {
+    std::ofstream file(path, std::ios::trunc);
+    file << PROFILE_MAGIC << " " << PROFILE_VERSION << "\n" << std::hex;
+    for (auto &[key, counts] : branches) {
+      file << key << " " << std::dec << counts.falseCount << " "
+           << counts.trueCount << std::hex << "\n";
+    }
+    if (!file.flush()) {
+      DIE << "Can't write profile " << path;
+    }
+  }
+
+  static BranchProfile load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+      DIE << "Can't open profile " << path << ": " << strerror(errno);
+    }
+
+    std::string magic;
+    int version = 0;
+    if (!(file >> magic >> version) || magic != PROFILE_MAGIC ||
+        version != PROFILE_VERSION) {
+      DIE << "Not a profile (or another version): " << path;
+    }
+
+    BranchProfile profile;
+    uint64_t key, falseCount, trueCount;
+    while (file >> std::hex >> key >> std::dec >> falseCount >> trueCount) {
+      profile.add(key, falseCount, trueCount);
+    }
+    if (!file.eof()) {
+      DIE << "Corrupt profile " << path;
+    }
+    return profile;
+  }
+
+private:
+  std::unordered_map<uint64_t, BranchCounts> branches;
+};
+
+#endif
@@ -0,0 +1,480 @@
+/**
+ * Eva heap snapshot
+ *
+ * Serializes an initialized VM heap (globals, and all strings, maps,
+ * instances and code objects reachable from them) into a file. A new
+ * VM maps the file and restores the heap instead of running the prelude.
+ *
+ * Format (native byte order):
+ *
+ *   header:  magic, version, code unit (instruction encoding),
+ *            object count, global count
+ *   objects: <type> <payload>, objects refer to each other by index
+ *            (property names are stored by name, shapes are rebuilt)
+ *   globals: <name> <value>
+ *
+ * Restore is two passes over the mapped file: allocate all objects,
+ * then fix up references (object indices -> pointers).
+ */
+
+#ifndef EVA_SNAPSHOT__H
+#define EVA_SNAPSHOT__H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../bytecode/op_code.h"
+#include "../parser/eva_parser.h"
+#include "eva_heap.h"
+#include "eva_instance.h"
+#include "eva_map.h"
+#include "eva_value.h"
+#include "global.h"
+#include "logger.h"
+
+#define SNAPSHOT_MAGIC "EVASNAP"
+#define SNAPSHOT_VERSION 8
+
+/**
+ * Snapshot writer
+ */
+class SnapshotWriter {
+public:
+  /**
+   * Writes globals and the reachable heap to the file
+   */
+  void save(const std::string &path, Global &global) {
+    for (size_t i = 0; i < global.size(); i++) {
+      visit(global.get(i).value);
+    }
+
+    // Header
+    out.append(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    writeU32(SNAPSHOT_VERSION);
+    writeU32(CODE_UNIT);
+    writeU32(objects.size());
+    writeU32(global.size());
+
+    // Objects
+    for (auto object : objects) {
+      writeObject(object);
+    }
+
+    // Globals
+    for (size_t i = 0; i < global.size(); i++) {
+      writeString(global.get(i).name);
+      writeValue(global.get(i).value);
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.write(out.data(), out.size())) {
+      DIE << "[EvaSnapshot]: can't write " << path;
+    }
+  }
+
+private:
+  /**
+   * Assigns indices to objects reachable from the value
+   */
+  void visit(const EvaValue &value) {
+    if (!IS_OBJECT(value) || indices.count(AS_OBJECT(value)) != 0) {
+      return;
+    }
+
+    auto object = AS_OBJECT(value);
+    indices[object] = objects.size();
+    objects.push_back(object);
+
+    switch (object->type) {
+    case ObjectType::CODE:
+      for (auto &constant : ((CodeObject *)object)->constants) {
+        visit(constant);
+      }
+      break;
+    case ObjectType::MAP:
+      ((MapObject *)object)->forEach([&](auto &key, auto &value) {
+        visit(key);
+        visit(value);
+      });
+      break;
+    case ObjectType::INSTANCE:
+      for (auto &value : ((InstanceObject *)object)->slots) {
+        visit(value);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  void writeObject(Object *object) {
+    writeU8((uint8_t)object->type);
+
+    switch (object->type) {
+    case ObjectType::STRING:
+      writeString(((StringObject *)object)->view());
+      break;
+
+    case ObjectType::CODE: {
+      auto co = (CodeObject *)object;
+      writeString(co->name);
+      writeU32(co->constants.size());
+      for (auto &constant : co->constants) {
+        writeValue(constant);
+      }
+      writeU32(co->code.size());
+      out.append((const char *)co->code.data(), co->code.size());
+      writeU32(co->maxStack);
+      writeU32(co->loops.size());
+      for (auto header : co->loops) {
+        writeU32(header);
+      }
+      writeU32(co->branches.size());
+      for (auto key : co->branches) {
+        writeRaw(key);
+      }
+      writeU32(co->propertyCaches.size());
+      for (auto &cache : co->propertyCaches) {
+        writeString(symbolName(cache.key));
+      }
+    } break;
+
+    case ObjectType::MAP: {
+      auto map = (MapObject *)object;
+      writeU32(map->count());
+      map->forEach([&](auto &key, auto &value) {
+        writeValue(key);
+        writeValue(value);
+      });
+    } break;
+
+    case ObjectType::INSTANCE: {
+      auto instance = (InstanceObject *)object;
+      writeU32(instance->slots.size());
+      instance->forEach([&](auto key, auto &value) {
+        writeString(symbolName(key));
+        writeValue(value);
+      });
+    } break;
+    }
+  }
+
+  void writeValue(const EvaValue &value) {
+    writeU8((uint8_t)value.type);
+    switch (value.type) {
+    case EvaValueType::NUMBER:
+      writeRaw(value.number);
+      break;
+    case EvaValueType::INT:
+      writeRaw(value.integer);
+      break;
+    case EvaValueType::BOOLEAN:
+      writeU8(value.boolean);
+      break;
+    case EvaValueType::OBJECT:
+      writeU32(indices.at(value.object));
+      break;
+    }
+  }
+
+  void writeString(std::string_view str) {
+    writeU32(str.size());
+    out.append(str);
+  }
+
+  void writeU8(uint8_t value) { out.push_back(value); }
+  void writeU32(uint32_t value) { writeRaw(value); }
+
+  template <typename T> void writeRaw(const T &value) {
+    out.append((const char *)&value, sizeof(value));
+  }
+
+  /**
+   * Output buffer
+   */
+  std::string out;
+
+  /**
+   * Reachable objects, and their indices
+   */
+  std::vector<Object *> objects;
+  std::unordered_map<Object *, uint32_t> indices;
+};
+
+/**
+ * Snapshot reader
+ */
+class SnapshotReader {
+public:
+  /**
+   * Maps the file, and restores globals and the heap
+   */
+  void load(const std::string &path, Global &global) {
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      DIE << "[EvaSnapshot]: can't open " << path;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+
+    auto data = size == 0 ? MAP_FAILED
+                          : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+      DIE << "[EvaSnapshot]: can't map " << path;
+    }
+
+    start = (const uint8_t *)data;
+    restore(global);
+    munmap(data, size);
+  }
+
+private:
+  void restore(Global &global) {
+    pos = start;
+
+    // The globals are replaced, there must be no frozen ones to keep
+    if (global.frozenSize() != 0) {
+      DIE << "[EvaSnapshot]: can't restore into globals with a frozen base";
+    }
+
+    if (size < sizeof(SNAPSHOT_MAGIC) ||
+        memcmp(pos, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+      DIE << "[EvaSnapshot]: not a snapshot file";
+    }
+    pos += sizeof(SNAPSHOT_MAGIC);
+
+    if (readU32() != SNAPSHOT_VERSION) {
+      DIE << "[EvaSnapshot]: unsupported snapshot version";
+    }
+
+    if (readU32() != CODE_UNIT) {
+      DIE << "[EvaSnapshot]: snapshot uses another instruction encoding";
+    }
+
+    auto objectCount = readU32();
+    auto globalCount = readU32();
+
+    // 1. Allocate objects, remember payload positions
+    auto objectsStart = pos;
+    objects.resize(objectCount);
+    for (uint32_t i = 0; i < objectCount; i++) {
+      objects[i] = allocateObject();
+    }
+    auto globalsStart = pos;
+
+    // 2. Fix up references now that all objects exist
+    pos = objectsStart;
+    for (uint32_t i = 0; i < objectCount; i++) {
+      fillObject(objects[i]);
+    }
+
+    // 3. Globals
+    pos = globalsStart;
+    global.clear();
+    for (uint32_t i = 0; i < globalCount; i++) {
+      auto name = readString();
+      global.addConst(name, readValue());
+    }
+  }
+
+  /**
+   * Allocates an object (strings are complete), skips the payload
+   */
+  Object *allocateObject() {
+    auto type = (ObjectType)readU8();
+
+    switch (type) {
+    case ObjectType::STRING:
+      return AS_OBJECT(ALLOC_STRING(readString()));
+
+    case ObjectType::CODE: {
+      auto co = AS_CODE(ALLOC_CODE(readString()));
+      auto constants = readU32();
+      for (uint32_t i = 0; i < constants; i++) {
+        skipValue();
+      }
+      skip(readU32());
+      skip(4);
+      skip(4 * readU32());
+      skip(8 * readU32());
+      auto caches = readU32();
+      for (uint32_t i = 0; i < caches; i++) {
+        skip(readU32());
+      }
+      return co;
+    }
+
+    case ObjectType::MAP: {
+      auto count = readU32();
+      for (uint32_t i = 0; i < 2 * count; i++) {
+        skipValue();
+      }
+      return AS_OBJECT(ALLOC_MAP());
+    }
+
+    case ObjectType::INSTANCE: {
+      auto count = readU32();
+      for (uint32_t i = 0; i < count; i++) {
+        skip(readU32());
+        skipValue();
+      }
+      return AS_OBJECT(ALLOC_INSTANCE(count));
+    }
+    }
+
+    DIE << "[EvaSnapshot]: unknown object type " << (int)type;
+    return nullptr; // Unreachable
+  }
+
+  /**
+   * Fills object references
+   */
+  void fillObject(Object *object) {
+    readU8();
+
+    switch (object->type) {
+    case ObjectType::STRING:
+      skip(readU32());
+      break;
+
+    case ObjectType::CODE: {
+      auto co = (CodeObject *)object;
+      skip(readU32());
+      auto constants = readU32();
+      for (uint32_t i = 0; i < constants; i++) {
+        co->constants.push_back(readValue());
+      }
+      auto codeSize = readU32();
+      check(codeSize);
+      co->code.assign(pos, pos + codeSize);
+      pos += codeSize;
+      co->maxStack = readU32();
+      auto loops = readU32();
+      for (uint32_t i = 0; i < loops; i++) {
+        co->loops.push_back(readU32());
+      }
+      auto branches = readU32();
+      for (uint32_t i = 0; i < branches; i++) {
+        co->branches.push_back(readRaw<uint64_t>());
+      }
+      auto caches = readU32();
+      for (uint32_t i = 0; i < caches; i++) {
+        co->propertyCaches.emplace_back(internSymbol(readString()));
+      }
+      resizeObject(co, co->byteSize());
+    } break;
+
+    case ObjectType::MAP: {
+      auto map = (MapObject *)object;
+      auto count = readU32();
+      for (uint32_t i = 0; i < count; i++) {
+        auto key = readValue();
+        map->set(key, readValue());
+      }
+    } break;
+
+    case ObjectType::INSTANCE: {
+      auto instance = (InstanceObject *)object;
+      auto count = readU32();
+      for (uint32_t i = 0; i < count; i++) {
+        auto key = internSymbol(readString());
+        instance->set(key, readValue());
+      }
+    } break;
+    }
+  }
+
+  EvaValue readValue() {
+    auto type = (EvaValueType)readU8();
+    switch (type) {
+    case EvaValueType::NUMBER:
+      return NUMBER(readRaw<double>());
+    case EvaValueType::INT:
+      return INT(readRaw<int64_t>());
+    case EvaValueType::BOOLEAN:
+      return BOOLEAN(readU8() != 0);
+    case EvaValueType::OBJECT: {
+      auto index = readU32();
+      if (index >= objects.size()) {
+        DIE << "[EvaSnapshot]: bad object reference " << index;
+      }
+      return (EvaValue){.type = EvaValueType::OBJECT,
+                        .object = objects[index]};
+    }
+    }
+
+    DIE << "[EvaSnapshot]: unknown value type " << (int)type;
+    return BOOLEAN(false); // Unreachable
+  }
+
+  void skipValue() {
+    auto type = (EvaValueType)readU8();
+    skip(type == EvaValueType::BOOLEAN  ? 1
+         : type == EvaValueType::OBJECT ? 4
+                                        : 8);
+  }
+
+  std::string readString() {
+    auto length = readU32();
+    check(length);
+    std::string str((const char *)pos, length);
+    pos += length;
+    return str;
+  }
+
+  uint8_t readU8() { return readRaw<uint8_t>(); }
+  uint32_t readU32() { return readRaw<uint32_t>(); }
+
+  template <typename T> T readRaw() {
+    check(sizeof(T));
+    T value;
+    memcpy(&value, pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+  }
+
+  void skip(size_t count) {
+    check(count);
+    pos += count;
+  }
+
+  /**
+   * Bounds check of the mapped file
+   */
+  void check(size_t count) {
+    if (pos + count > start + size) {
+      DIE << "[EvaSnapshot]: truncated snapshot";
+    }
+  }
+
+  /**
+   * Mapped file
+   */
+  const uint8_t *start;
+  size_t size;
+
+  /**
+   * Read position
+   */
+  const uint8_t *pos;
+
+  /**
+   * Restored objects by index
+   */
+  std::vector<Object *> objects;
+};
+
+#endif
@@ -0,0 +1,126 @@
+/**
+ * Eva string builtins
+ *
+ * substring, find, split and trim, run by OP_STRING <builtin>. Results
+ * are slices of the argument (see StringObject): tokenizing a line
+ * allocates a header per field, and copies no characters.
+ */
+
+#ifndef EVA_STRING__H
+#define EVA_STRING__H
+
+#include <cstdint>
+#include <string_view>
+
+#include "eva_heap.h"
+#include "eva_map.h"
+#include "eva_value.h"
+#include "logger.h"
+
+/**
+ * Builtins by OP_STRING operand
+ */
+enum StringBuiltin : uint8_t {
+  // (substring s start end): characters [start, end)
+  STRING_SUBSTRING,
+
+  // (string-find s needle): index of the first match, -1 if none
+  STRING_FIND,
+
+  // (string-split s separator): array-like map of the fields
+  STRING_SPLIT,
+
+  // (string-trim s): without leading and trailing whitespace
+  STRING_TRIM,
+
+  // (string-length s)
+  STRING_LENGTH,
+};
+
+/**
+ * Number of builtins (keep in sync with StringBuiltin)
+ */
+#define STRING_BUILTINS_COUNT 5
+
+/**
+ * Builtin names, by StringBuiltin
+ */
+static constexpr const char *stringBuiltinNames[] = {
+    "substring", "string-find", "string-split", "string-trim",
+    "string-length"};
+
+/**
+ * Number of arguments of a builtin
+ */
+size_t stringBuiltinArity(uint8_t builtin) {
+  switch (builtin) {
+  case STRING_SUBSTRING:
+    return 3;
+  case STRING_FIND:
+  case STRING_SPLIT:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+/**
+ * Characters [start, end) of the string
+ */
+EvaValue substring(StringObject *str, int64_t start, int64_t end) {
+  if (start < 0 || end < start || (size_t)end > str->length) {
+    DIE << "substring: range [" << start << ", " << end
+        << ") is out of a string of length " << str->length;
+  }
+  return ALLOC_SLICE(str, start, end - start);
+}
+
+/**
+ * Index of the first occurrence of the needle, -1 if none
+ */
+int64_t stringFind(StringObject *str, StringObject *needle) {
+  auto index = str->view().find(needle->view());
+  return index == std::string_view::npos ? -1 : (int64_t)index;
+}
+
+/**
+ * Fields between separators, as an array-like map (keys 0..N-1).
+ * Empty fields are kept, so N is the number of separators plus one.
+ */
+EvaValue stringSplit(StringObject *str, StringObject *separator) {
+  if (separator->length == 0) {
+    DIE << "string-split: empty separator";
+  }
+
+  auto chars = str->view();
+  auto map = ALLOC_MAP();
+  int64_t count = 0;
+  size_t from = 0;
+
+  for (;;) {
+    auto to = chars.find(separator->view(), from);
+    auto end = to == std::string_view::npos ? chars.size() : to;
+    AS_MAP(map)->set(INT(count++), ALLOC_SLICE(str, from, end - from));
+    if (to == std::string_view::npos) {
+      break;
+    }
+    from = to + separator->length;
+  }
+
+  return map;
+}
+
+/**
+ * The string without leading and trailing whitespace
+ */
+EvaValue stringTrim(StringObject *str) {
+  auto chars = str->view();
+  auto start = chars.find_first_not_of(" \t\r\n\v\f");
+  if (start == std::string_view::npos) {
+    return ALLOC_SLICE(str, 0, 0);
+  }
+  auto end = chars.find_last_not_of(" \t\r\n\v\f") + 1;
+  return ALLOC_SLICE(str, start, end - start);
+}
+
+#endif
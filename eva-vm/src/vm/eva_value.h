@@ -5,7 +5,12 @@
 #ifndef EVA_VALUE__H
 #define EVA_VALUE__H
 
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "logger.h"
@@ -15,6 +20,7 @@
  */
 enum class EvaValueType {
   NUMBER,
+  INT,
   BOOLEAN,
   OBJECT,
 };
@@ -22,23 +28,118 @@ enum class EvaValueType {
 /**
  * Object type
  */
-enum class ObjectType {
+enum class ObjectType : uint8_t {
   STRING,
   CODE,
+  MAP,
+  INSTANCE,
 };
 
+/**
+ * Number of object types (keep in sync with ObjectType)
+ */
+#define OBJECT_TYPES_COUNT 4
+
 /**
  * Base object
  */
 struct Object {
   Object(ObjectType type) : type(type) {}
   ObjectType type;
+
+  /**
+   * Slab size class the object is allocated from (0: large object)
+   */
+  uint8_t sizeClass = 0;
+
+  /**
+   * Shared through a frozen table (see global.h): immutable
+   */
+  bool frozen = false;
+
+  /**
+   * Bytes charged to the VM heap (see eva_heap.h)
+   */
+  uint32_t heapSize = 0;
 };
 
+/**
+ * String hash (FNV-1a), cached in the string object
+ */
+size_t hashString(std::string_view str) {
+  uint64_t hash = 14695981039346656037ull;
+  for (auto c : str) {
+    hash ^= (uint8_t)c;
+    hash *= 1099511628211ull;
+  }
+  return (size_t)hash;
+}
+
+/**
+ * String object. A flat string stores its characters inline right after
+ * the header, so it is one allocation (see allocString in eva_heap.h).
+ * A slice refers to a range of a flat string, its parent, which it keeps
+ * alive: substrings share the characters, and only allocate a header.
+ */
 struct StringObject : public Object {
-  StringObject(const std::string &str)
-      : Object(ObjectType::STRING), string(str) {}
-  std::string string;
+  StringObject(std::string_view str, std::string_view suffix = {})
+      : Object(ObjectType::STRING), length(str.size() + suffix.size()),
+        data((const char *)(this + 1)) {
+    auto chars = (char *)(this + 1);
+    memcpy(chars, str.data(), str.size());
+    memcpy(chars + str.size(), suffix.data(), suffix.size());
+    chars[length] = '\0';
+  }
+
+  /**
+   * Slice of a string (a slice of a slice refers to the flat parent)
+   */
+  StringObject(StringObject *str, size_t offset, size_t length)
+      : Object(ObjectType::STRING), length(length), data(str->data + offset),
+        parent(str->parent != nullptr ? str->parent : str) {}
+
+  /**
+   * Number of characters
+   */
+  size_t length;
+
+  /**
+   * Characters: inline (null-terminated), or in the parent
+   */
+  const char *data;
+
+  /**
+   * Flat string owning the characters of a slice (nullptr: flat)
+   */
+  StringObject *parent = nullptr;
+
+  std::string_view view() const { return {data, length}; }
+
+  /**
+   * Hash, used by map keys. Computed on first use, so a slice costs
+   * nothing per character until it is hashed.
+   */
+  size_t hash() const {
+    auto cached = hash_.load(std::memory_order_relaxed);
+    if (cached == 0) {
+      cached = hashString(view());
+      hash_.store(cached, std::memory_order_relaxed);
+    }
+    return cached;
+  }
+
+  /**
+   * Allocated size, charged to the heap
+   */
+  size_t byteSize() const {
+    return sizeof(*this) + (parent == nullptr ? length + 1 : 0);
+  }
+
+private:
+  /**
+   * Cached hash (0: not computed yet)
+   */
+  mutable std::atomic<size_t> hash_{0};
 };
 
 /**
@@ -48,11 +149,64 @@ struct EvaValue {
   EvaValueType type;
   union {
     double number;
+    int64_t integer;
     bool boolean;
     Object *object;
   };
 };
 
+struct Shape;
+
+/**
+ * Entries of a property inline cache: monomorphic or polymorphic up to
+ * 4 shapes, then megamorphic (lookups go to the shape)
+ */
+#define PROPERTY_CACHE_SIZE 4
+
+/**
+ * Cached property location in instances of a shape. An entry is filled
+ * once, and its shape is published last, so VMs sharing the code
+ * (parallel workers, frozen code) read entries without locks.
+ */
+struct PropertyCacheEntry {
+  std::atomic<Shape *> shape{nullptr};
+
+  /**
+   * Shape after adding the property, if the shape lacks it (set)
+   */
+  Shape *transition = nullptr;
+
+  uint32_t slot = 0;
+};
+
+/**
+ * Inline cache of a property instruction (see eva_instance.h)
+ */
+struct PropertyCache {
+  PropertyCache(uint32_t key) : key(key) {}
+
+  PropertyCache(const PropertyCache &other) { *this = other; }
+
+  PropertyCache &operator=(const PropertyCache &other) {
+    key = other.key;
+    for (auto i = 0; i < PROPERTY_CACHE_SIZE; i++) {
+      entries[i].shape = other.entries[i].shape.load();
+      entries[i].transition = other.entries[i].transition;
+      entries[i].slot = other.entries[i].slot;
+    }
+    return *this;
+  }
+
+  /**
+   * Property name (interned symbol ID)
+   */
+  uint32_t key;
+
+  PropertyCacheEntry entries[PROPERTY_CACHE_SIZE];
+};
+
+struct LazyCode;
+
 /**
  * Code object
  */
@@ -73,6 +227,44 @@ struct CodeObject : public Object {
    * Bytecode
    */
   std::vector<uint8_t> code;
+
+  /**
+   * Loop headers (bytecode offsets), by loop index
+   */
+  std::vector<size_t> loops;
+
+  /**
+   * Profile keys of conditional branches (see branchKey), by branch index
+   */
+  std::vector<uint64_t> branches;
+
+  /**
+   * Inline caches of property instructions, by cache index
+   */
+  std::vector<PropertyCache> propertyCaches;
+
+  /**
+   * Deepest operand stack the code reaches (the compiler rejects code
+   * deeper than the stack it runs on)
+   */
+  size_t maxStack = 0;
+
+  /**
+   * Source of a callable compiled on its first call (see
+   * EvaCompiler::compileLazy), nullptr for code compiled eagerly
+   */
+  std::shared_ptr<LazyCode> lazy;
+
+  /**
+   * Allocated size, charged to the heap
+   */
+  size_t byteSize() const {
+    return sizeof(*this) + name.capacity() +
+           constants.capacity() * sizeof(EvaValue) + code.capacity() +
+           loops.capacity() * sizeof(size_t) +
+           branches.capacity() * sizeof(uint64_t) +
+           propertyCaches.capacity() * sizeof(PropertyCache);
+  }
 };
 
 // ----------------------------------------------------------------------
@@ -81,40 +273,71 @@ struct CodeObject : public Object {
 #define NUMBER(value)                                                          \
   ((EvaValue){.type = EvaValueType::NUMBER, .number = value})
 
+#define INT(value)                                                             \
+  ((EvaValue){.type = EvaValueType::INT, .integer = value})
+
 #define BOOLEAN(value)                                                         \
   ((EvaValue){.type = EvaValueType::BOOLEAN, .boolean = value})
 
-#define ALLOC_STRING(value)                                                    \
+// ALLOC_STRING(str) or ALLOC_STRING(str, suffix) (concatenation)
+#define ALLOC_STRING(...)                                                      \
   ((EvaValue){.type = EvaValueType::OBJECT,                                    \
-              .object = (Object *)new StringObject(value)})
+              .object = (Object *)allocString(__VA_ARGS__)})
+
+// ALLOC_SLICE(str, offset, length): shares the characters of str
+#define ALLOC_SLICE(str, offset, length)                                       \
+  ((EvaValue){.type = EvaValueType::OBJECT,                                    \
+              .object = (Object *)allocSlice(str, offset, length)})
 
 #define ALLOC_CODE(name)                                                       \
   ((EvaValue){.type = EvaValueType::OBJECT,                                    \
-              .object = (Object *)new CodeObject(name)})
+              .object = (Object *)allocObject<CodeObject>(name)})
+
+#define ALLOC_MAP()                                                            \
+  ((EvaValue){.type = EvaValueType::OBJECT,                                    \
+              .object = (Object *)allocObject<MapObject>()})
+
+// ALLOC_INSTANCE(capacity): empty instance with room for slots
+#define ALLOC_INSTANCE(capacity)                                               \
+  ((EvaValue){.type = EvaValueType::OBJECT,                                    \
+              .object = (Object *)allocObject<InstanceObject>(capacity)})
 
 // ----------------------------------------------------------------------
 // Accessors
 
 #define AS_NUMBER(evaValue) ((double)(evaValue).number)
+#define AS_INT(evaValue) ((int64_t)(evaValue).integer)
 #define AS_BOOLEAN(evaValue) ((bool)(evaValue).boolean)
+
+// Numeric value as double (promotes INT)
+#define AS_DOUBLE(evaValue)                                                    \
+  (IS_INT(evaValue) ? (double)AS_INT(evaValue) : AS_NUMBER(evaValue))
+
 #define AS_OBJECT(evaValue) ((Object *)(evaValue).object)
 #define AS_CODE(evaValue) ((CodeObject *)(evaValue).object)
 
 #define AS_STRING(evaValue) (((StringObject *)evaValue.object))
-#define AS_CPPSTRING(evaValue) (AS_STRING(evaValue)->string)
+#define AS_CPPSTRING(evaValue) (AS_STRING(evaValue)->view())
+#define AS_MAP(evaValue) ((MapObject *)(evaValue).object)
+#define AS_INSTANCE(evaValue) ((InstanceObject *)(evaValue).object)
 
 // ----------------------------------------------------------------------
 // Testers:
 
 #define IS_NUMBER(evaValue) (evaValue.type == EvaValueType::NUMBER)
+#define IS_INT(evaValue) (evaValue.type == EvaValueType::INT)
 #define IS_BOOLEAN(evaValue) (evaValue.type == EvaValueType::BOOLEAN)
 #define IS_OBJECT(evaValue) (evaValue.type == EvaValueType::OBJECT)
 
+#define IS_NUMERIC(evaValue) (IS_NUMBER(evaValue) || IS_INT(evaValue))
+
 #define IS_OBJECT_TYPE(evaValue, objectType)                                   \
   (IS_OBJECT(evaValue) && AS_OBJECT(evaValue)->type == objectType)
 
 #define IS_STRING(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::STRING)
 #define IS_CODE(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CODE)
+#define IS_MAP(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::MAP)
+#define IS_INSTANCE(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::INSTANCE)
 
 /**
  * String representation used in constants for debug
@@ -123,6 +346,9 @@ std::string evaValueToTypeString(const EvaValue &evaValue) {
   if (IS_NUMBER(evaValue))
     return "NUMBER";
 
+  if (IS_INT(evaValue))
+    return "INT";
+
   if (IS_BOOLEAN(evaValue))
     return "BOOLEAN";
 
@@ -132,6 +358,12 @@ std::string evaValueToTypeString(const EvaValue &evaValue) {
   if (IS_CODE(evaValue))
     return "CODE";
 
+  if (IS_MAP(evaValue))
+    return "MAP";
+
+  if (IS_INSTANCE(evaValue))
+    return "INSTANCE";
+
   DIE << "evaValueToTypeString: unknown type " << (int)evaValue.type;
 
   return ""; // Unrechable
@@ -144,6 +376,8 @@ std::string evaValueToConstantString(const EvaValue &evaValue) {
   std::stringstream ss;
   if (IS_NUMBER(evaValue)) {
     ss << AS_NUMBER(evaValue);
+  } else if (IS_INT(evaValue)) {
+    ss << AS_INT(evaValue);
   } else if (IS_BOOLEAN(evaValue)) {
     ss << (evaValue.boolean == true ? "true" : "false");
   } else if (IS_STRING(evaValue)) {
@@ -151,6 +385,10 @@ std::string evaValueToConstantString(const EvaValue &evaValue) {
   } else if (IS_CODE(evaValue)) {
     auto code = AS_CODE(evaValue);
     ss << "code" << code << ":" << code->name;
+  } else if (IS_MAP(evaValue)) {
+    ss << "map" << AS_OBJECT(evaValue);
+  } else if (IS_INSTANCE(evaValue)) {
+    ss << "instance" << AS_OBJECT(evaValue);
   } else {
     DIE << "evaValueToConstantString: unknown type " << (int)evaValue.type;
   }
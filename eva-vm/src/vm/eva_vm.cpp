@@ -1,33 +1,185 @@
 #include "eva_vm.h"
 #include "logger.h"
+#include "mapped_file.h"
 
+#include <chrono>
 #include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/**
+ * Command line options
+ */
+struct Options {
+  bool compileOnly = false;
+  bool disassemble = true;
+  bool stats = false;
+  bool trace = false;
+
+  /**
+   * Branch profile to compile with, and to record into
+   */
+  std::string profile;
+  std::string profileOut;
+
+  /**
+   * Script paths ("-" is stdin)
+   */
+  std::vector<std::string> scripts;
+};
+
+void printUsage() {
+  std::cerr << "Usage: eva_vm [options] <script>...\n\n"
+            << "Runs each script (\"-\" reads stdin) in one VM.\n\n"
+            << "Options:\n"
+            << "  --compile-only  compile without running\n"
+            << "  --no-disasm     don't print the disassembly\n"
+            << "  --stats         print run stats to stderr\n"
+            << "  --trace         trace instructions (debug build)\n"
+            << "  --profile <file>      lay out branches by a profile\n"
+            << "  --profile-out <file>  record a branch profile\n";
+}
+
+/**
+ * Prints stats of the last run to stderr
+ */
+void printStats(EvaVM<> &vm, const std::string &script,
+                std::chrono::duration<double, std::milli> time) {
+  std::cerr << std::dec << "--- " << script << ": " << time.count()
+            << " ms, " << vm.instructionCount() << " instructions, "
+            << vm.jumpCount() << " jumps taken\n"
+            << vm.heapStats();
+
+  auto output = vm.outputStats();
+  if (output.bytes != 0) {
+    std::cerr << "Output: " << output.bytes << " bytes, " << output.writes
+              << " writes, " << output.stalls << " stalls\n";
+  }
+
+  for (auto &loop : vm.hotLoops()) {
+    std::cerr << "  loop " << loop.co->name << "@" << loop.header << ": "
+              << loop.backEdges << " back-edges\n";
+  }
+}
+
+/**
+ * Runs (or compiles) a script, returns false on error
+ */
+bool runScript(EvaVM<> &vm, const std::string &script, const Options &options) {
+  auto start = std::chrono::steady_clock::now();
+
+  auto run = vm.recover([&]() {
+    // stdin is streamed, files are mapped and parsed in place
+    if (script == "-" && !options.compileOnly) {
+      return vm.execFd(0);
+    }
+
+    if (script == "-") {
+      std::string source{std::istreambuf_iterator<char>(std::cin), {}};
+      vm.compile(source);
+      return BOOLEAN(true);
+    }
+
+    MappedFile file(script);
+    if (options.compileOnly) {
+      vm.compile(file.view());
+      return BOOLEAN(true);
+    }
+    return vm.exec(file.view());
+  });
+
+  if (options.stats) {
+    printStats(vm, script, std::chrono::steady_clock::now() - start);
+  }
+
+  if (!run.ok()) {
+    std::cerr << script << ": " << *run.error << '\n';
+    return false;
+  }
+
+  if (!options.compileOnly) {
+    auto result = run.value;
+    log(result);
+  }
+
+  return true;
+}
+
+/**
+ * Calls fn outside of a script, returns false on error
+ */
+template <typename Fn> bool tryCall(EvaVM<> &vm, Fn fn) {
+  auto call = vm.recover([&]() {
+    fn();
+    return BOOLEAN(true);
+  });
+
+  if (!call.ok()) {
+    std::cerr << *call.error << '\n';
+  }
+  return call.ok();
+}
 
 /**
  * Eva VM main executable
  */
 int main(int argc, char const **argv) {
+  Options options;
 
-  EvaVM vm;
-
-  auto result = vm.exec(R"(
+  for (auto i = 1; i < argc; i++) {
+    std::string arg = argv[i];
 
-    (set x (+ x 10))
+    if (arg == "--compile-only") {
+      options.compileOnly = true;
+    } else if (arg == "--no-disasm") {
+      options.disassemble = false;
+    } else if (arg == "--stats") {
+      options.stats = true;
+    } else if (arg == "--trace") {
+      options.trace = true;
+    } else if ((arg == "--profile" || arg == "--profile-out") &&
+               i + 1 < argc) {
+      (arg == "--profile" ? options.profile : options.profileOut) = argv[++i];
+    } else if (arg == "--help" || arg == "-h") {
+      printUsage();
+      return 0;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      std::cerr << "Unknown option: " << arg << "\n\n";
+      printUsage();
+      return 2;
+    } else {
+      options.scripts.push_back(arg);
+    }
+  }
 
-    x
+  if (options.scripts.empty()) {
+    printUsage();
+    return 2;
+  }
 
-    (begin
-        (var x 100)
-        x)
+  EvaVM vm;
+  vm.setDisassemble(options.disassemble);
 
-    x
+  if (options.trace && !tryCall(vm, [&]() { vm.setTrace(true); })) {
+    return 1;
+  }
 
-  )");
+  if (!options.profile.empty() &&
+      !tryCall(vm, [&]() { vm.loadProfile(options.profile); })) {
+    return 1;
+  }
 
-  std::cout << '\n';
-  log(result);
+  for (auto &script : options.scripts) {
+    if (!runScript(vm, script, options)) {
+      return 1;
+    }
+  }
 
-  std::cout << "All done!\n";
+  if (!options.profileOut.empty() &&
+      !tryCall(vm, [&]() { vm.saveProfile(options.profileOut); })) {
+    return 1;
+  }
 
   return 0;
 }
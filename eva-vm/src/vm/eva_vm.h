@@ -5,19 +5,43 @@
 #ifndef EVA_VM__H
 #define EVA_VM__H
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "../bytecode/op_code.h"
 #include "../parser/eva_parser.h"
+#include "../parser/eva_stream_parser.h"
+#include "eva_aot.h"
 #include "eva_compiler.h"
+#include "eva_fiber.h"
+#include "eva_heap.h"
+#include "eva_instance.h"
+#include "eva_map.h"
+#include "eva_output.h"
+#include "eva_parallel_compiler.h"
+#include "eva_policy.h"
+#include "eva_profile.h"
+#include "eva_snapshot.h"
+#include "eva_string.h"
 #include "eva_value.h"
+#include "eva_work_pool.h"
 #include "global.h"
 #include "logger.h"
 
-using syntax::EvaParser;
-
 /**
  * Reads the current byte in the bytecode
  * and advances the ip pointer
@@ -30,23 +54,84 @@ using syntax::EvaParser;
 #define READ_SHORT() (ip += 2, (ip[-2] << 8) | ip[-1])
 
 /**
- * Converts bytecode index to a pointer
+ * Reads a word (4 bytes)
+ */
+#define READ_WORD()                                                            \
+  (ip += 4, ((uint32_t)ip[-4] << 24) | ((uint32_t)ip[-3] << 16) |              \
+                ((uint32_t)ip[-2] << 8) | ip[-1])
+
+#ifdef EVA_WIDE_CODE
+
+/**
+ * Fetches the instruction word, the opcode is its low byte
+ */
+#define READ_OPCODE() (instruction = decodeWord(ip), ip += 4, instruction & 0xFF)
+
+/**
+ * First operand (bits 8-31 of the instruction word)
+ */
+#define READ_OPERAND() (instruction >> 8)
+#define READ_OPERAND_SHORT() (instruction >> 8)
+#define READ_ADDRESS() (instruction >> 8)
+
+/**
+ * Next operand: a whole extension word
+ */
+#define READ_NEXT_OPERAND() (ip += 4, decodeWord(ip - 4))
+
+#else
+
+#define READ_OPCODE() READ_BYTE()
+
+/**
+ * First operand: a byte, a short (wide indices), or a word (addresses)
  */
-#define TO_ADDRESS(index) (&co->code[index])
+#define READ_OPERAND() READ_BYTE()
+#define READ_OPERAND_SHORT() READ_SHORT()
+#define READ_ADDRESS() READ_WORD()
+
+/**
+ * Next operand (addresses, branch and loop indices)
+ */
+#define READ_NEXT_OPERAND() READ_WORD()
+
+#endif
+
+/**
+ * Converts a code address to a pointer
+ */
+#define TO_ADDRESS(index) (&co->code[(index) * CODE_UNIT])
 
 /**
  * Gets a constant from the pool
  */
-#define GET_CONST() (co->constants[READ_BYTE()])
+#define GET_CONST() (co->constants[READ_OPERAND()])
 
 /**
  * Binary operation
  */
 #define BINARY_OP(op)                                                          \
   do {                                                                         \
-    auto op2 = AS_NUMBER(pop());                                               \
-    auto op1 = AS_NUMBER(pop());                                               \
-    push(NUMBER(op1 op op2));                                                  \
+    auto op2 = popNumeric();                                                   \
+    auto op1 = popNumeric();                                                   \
+    push(NUMBER(AS_DOUBLE(op1) op AS_DOUBLE(op2)));                            \
+  } while (0)
+
+/**
+ * Integer binary operation with overflow check,
+ * promotes to double on overflow or mixed operands
+ */
+#define INT_BINARY_OP(op, checked)                                             \
+  do {                                                                         \
+    auto op2 = popNumeric();                                                   \
+    auto op1 = popNumeric();                                                   \
+    int64_t res;                                                               \
+    if (IS_INT(op1) && IS_INT(op2) &&                                          \
+        !checked(AS_INT(op1), AS_INT(op2), &res)) {                            \
+      push(INT(res));                                                          \
+    } else {                                                                   \
+      push(NUMBER(AS_DOUBLE(op1) op AS_DOUBLE(op2)));                          \
+    }                                                                          \
   } while (0)
 
 /**
@@ -74,30 +159,181 @@ using syntax::EvaParser;
     case 5:                                                                    \
       res = v1 != v2;                                                          \
       break;                                                                   \
+    default:                                                                   \
+      DIE << "Unknown compare op: " << op;                                     \
     }                                                                          \
     push(BOOLEAN(res));                                                        \
   } while (0)
 
 /**
- * Stack top (stack overflow after exceeding)
+ * Budget checkpoint (at back-edges): a suspended run returns
+ * from eval, and is continued by resume()
+ */
+#define CHECK_FUEL()                                                           \
+  do {                                                                         \
+    if (instructions >= fuelCheck && outOfFuel()) {                            \
+      return BOOLEAN(false);                                                   \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Items per task of parallel builtins (fixed, so results don't
+ * depend on the number of threads)
+ */
+#define PARALLEL_CHUNK_SIZE 1024
+
+/**
+ * Program compiled once, evaluated for many input bindings
+ */
+struct BatchProgram {
+  CodeObject *co;
+
+  /**
+   * Global indices of the inputs, in column order
+   */
+  std::vector<int> inputs;
+};
+
+/**
+ * Columnar inputs of a batch: one column of values per input
+ */
+using BatchColumns = std::vector<std::vector<EvaValue>>;
+
+/**
+ * Result of a program: the value, or an error
+ */
+struct EvaResult {
+  EvaValue value;
+  std::optional<EvaError> error;
+
+  /**
+   * Ran out of budget, and can be resumed
+   */
+  bool suspended = false;
+
+  bool ok() const { return !error.has_value(); }
+};
+
+/**
+ * What happens when a run is out of budget
+ */
+enum class FuelPolicy {
+  ABORT,
+  SUSPEND,
+};
+
+/**
+ * Budget of each run (0 is unlimited). Checked at loop back-edges,
+ * the clock only every FUEL_CLOCK_INTERVAL instructions.
+ */
+struct Budget {
+  uint64_t instructions = 0;
+  std::chrono::nanoseconds time{0};
+  FuelPolicy policy = FuelPolicy::ABORT;
+};
+
+/**
+ * Instructions between clock reads of a time budget
+ */
+#define FUEL_CLOCK_INTERVAL (64 * 1024)
+
+/**
+ * Instructions a parallel worker draws from the shared budget at once
+ */
+#define FUEL_SLICE 1024
+
+/**
+ * Loop with its back-edge count (hotness), for later tiering
  */
-#define STACK_LIMIT 512
+struct HotLoop {
+  CodeObject *co;
+  size_t header;
+  uint64_t backEdges;
+};
 
-class EvaVM {
+/**
+ * Eva VM, specialized at compile time by a policy (see eva_policy.h)
+ */
+template <typename Policy = DefaultPolicy> class EvaVM {
 public:
   EvaVM()
       : global(std::make_unique<Global>()),
         parser(std::make_unique<EvaParser>()),
-        compiler(std::make_unique<EvaCompiler>(global)) {
+        streamParser(std::make_unique<EvaStreamParser>(*parser)),
+        compiler(std::make_unique<EvaCompiler<Policy>>(global)) {
+    resetFibers();
     setGlobalVariables();
   }
 
+  /**
+   * Starts from a heap snapshot, instead of setting up
+   * globals and running the prelude
+   */
+  explicit EvaVM(const std::string &snapshotPath)
+      : global(std::make_unique<Global>()),
+        parser(std::make_unique<EvaParser>()),
+        streamParser(std::make_unique<EvaStreamParser>(*parser)),
+        compiler(std::make_unique<EvaCompiler<Policy>>(global)) {
+    resetFibers();
+    HeapScope heapScope(&heap);
+    SnapshotReader().load(snapshotPath, *global);
+  }
+
+  /**
+   * Worker VM of parallel builtins: shares the globals (read-only
+   * while workers run), has its own stack
+   */
+  explicit EvaVM(std::shared_ptr<Global> global)
+      : global(global), parser(std::make_unique<EvaParser>()),
+        streamParser(std::make_unique<EvaStreamParser>(*parser)),
+        compiler(std::make_unique<EvaCompiler<Policy>>(global)) {
+    resetFibers();
+  }
+
+  /**
+   * Starts from a frozen table shared with other VMs: frozen globals
+   * are copied on first write, new globals are private to this VM
+   */
+  explicit EvaVM(std::shared_ptr<const FrozenTable> frozen)
+      : global(std::make_shared<Global>(frozen)),
+        parser(std::make_unique<EvaParser>()),
+        streamParser(std::make_unique<EvaStreamParser>(*parser)),
+        compiler(std::make_unique<EvaCompiler<Policy>>(global)) {
+    resetFibers();
+  }
+
+  /**
+   * Freezes the globals and all objects reachable from them into a
+   * table to share with other VMs (see EvaVM(frozen)). This VM also
+   * continues on top of the table.
+   */
+  std::shared_ptr<const FrozenTable> freeze() {
+    auto table = std::make_shared<FrozenTable>();
+    table->globals.reserve(global->size());
+    for (size_t i = 0; i < global->size(); i++) {
+      table->globals.push_back(global->get(i));
+      table->indices.emplace(global->get(i).name, i);
+      freezeValue(global->get(i).value, *table);
+    }
+    global->rebase(table);
+    return table;
+  }
+
+  /**
+   * Saves the heap (globals and reachable objects) to a snapshot
+   */
+  void saveSnapshot(const std::string &path) {
+    SnapshotWriter().save(path, *global);
+  }
+
   /**
    * Pushes a value onto the stack
    */
   void push(const EvaValue &value) {
-    if ((size_t)(sp - stack.begin()) == STACK_LIMIT)
-      DIE << "push(): Stack overflow.\n";
+    if constexpr (Policy::checkStack) {
+      if (sp == stackLimit)
+        DIE << "push(): Stack overflow.\n";
+    }
     *sp = value;
     sp++;
   }
@@ -106,8 +342,10 @@ public:
    *  Pops a value from the stack
    */
   EvaValue pop() {
-    if (sp == stack.begin())
-      DIE << "pop(): empty stack.\n";
+    if constexpr (Policy::checkStack) {
+      if (sp == stackBase)
+        DIE << "pop(): empty stack.\n";
+    }
     --sp;
     return *sp;
   }
@@ -116,181 +354,1621 @@ public:
    * Peeks an element from the stack
    */
   EvaValue peek(size_t offset = 0) {
-    if (stack.size() == 0) {
-      DIE << "peek(): empty stack.\n";
+    if constexpr (Policy::checkStack) {
+      if (sp - stackBase <= (ptrdiff_t)offset) {
+        DIE << "peek(): empty stack.\n";
+      }
     }
     return *(sp - 1 - offset);
   }
 
   /**
-   * Executes a program
+   * Pops a number or an integer from the stack
    */
-  EvaValue exec(const std::string &program) {
-    // 1. Parse the program
-    auto ast = parser->parse(program);
+  EvaValue popNumeric() {
+    auto value = pop();
+    if (!IS_NUMERIC(value)) {
+      DIE << "Expected a number, got: " << value;
+    }
+    return value;
+  }
 
-    // 2. Compile program to Eva bytecode
-    co = compiler->compile(ast);
+  /**
+   * Pops an integer from the stack
+   */
+  int64_t popInt() {
+    auto value = pop();
+    if (!IS_INT(value)) {
+      DIE << "Expected an integer, got: " << value;
+    }
+    return AS_INT(value);
+  }
 
-    // Init the stack
-    sp = &stack[0];
+  /**
+   * Pops a string from the stack
+   */
+  StringObject *popString() {
+    auto value = pop();
+    if (!IS_STRING(value)) {
+      DIE << "Expected a string, got: " << value;
+    }
+    return AS_STRING(value);
+  }
 
-    // Set instruction pointer to the beginning:
-    ip = &co->code[0];
+  /**
+   * Pops a map from the stack
+   */
+  MapObject *popMap() {
+    auto value = pop();
+    if (!IS_MAP(value)) {
+      DIE << "Expected a map, got: " << value;
+    }
+    return AS_MAP(value);
+  }
 
-    // Debug disassembly
-    compiler->disassembleBytecode();
+  /**
+   * Pops a map to modify (frozen maps are read-only)
+   */
+  MapObject *popMutableMap() {
+    auto map = popMap();
+    if (map->frozen) {
+      DIE << "Can't modify a frozen map";
+    }
+    return map;
+  }
 
-    return eval();
+  /**
+   * Pops an instance from the stack
+   */
+  InstanceObject *popInstance() {
+    auto value = pop();
+    if (!IS_INSTANCE(value)) {
+      DIE << "Expected an instance, got: " << value;
+    }
+    return AS_INSTANCE(value);
   }
 
   /**
-   * Main eval lopp
+   * Pops an instance to modify (frozen instances are read-only)
    */
-  EvaValue eval() {
-    for (;;) {
-      auto opcode = READ_BYTE();
+  InstanceObject *popMutableInstance() {
+    auto instance = popInstance();
+    if (instance->frozen) {
+      DIE << "Can't modify a frozen instance";
+    }
+    return instance;
+  }
 
-      switch (opcode) {
-      case OP_HALT:
-        return pop();
+  /**
+   * Property lookup on an inline cache miss, fills the cache
+   */
+  EvaValue getProperty(InstanceObject *instance, PropertyCache &cache) {
+    auto slot = instance->shape->find(cache.key);
+    if (slot == -1) {
+      DIE << "prop: property not found: " << symbolName(cache.key);
+    }
+    fillCache(cache, instance->shape, slot);
+    return instance->slots[slot];
+  }
 
-        // ---------------
-        // Constants:
-      case OP_CONST:
-        push(GET_CONST());
-        break;
+  /**
+   * Sets a property through the inline cache: stores into the cached
+   * slot, or takes the cached transition (adding the property)
+   */
+  void setProperty(InstanceObject *instance, PropertyCache &cache,
+                   const EvaValue &value) {
+    auto shape = instance->shape;
+    auto entry = probeCache(cache, shape);
 
-        // ---------------
-        // Math ops:
-      case OP_ADD: {
+    if (entry == nullptr) {
+      auto slot = shape->find(cache.key);
+      if (slot != -1) {
+        fillCache(cache, shape, slot);
+        instance->slots[slot] = value;
+      } else {
+        auto next = shape->transition(cache.key);
+        fillCache(cache, shape, shape->slotsCount(), next);
+        instance->addProperty(next, value);
+      }
+      return;
+    }
 
-        auto op2 = pop();
-        auto op1 = pop();
+    if (entry->transition != nullptr) {
+      instance->addProperty(entry->transition, value);
+    } else {
+      instance->slots[entry->slot] = value;
+    }
+  }
 
-        /// Numeric addition
-        if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
-          auto v1 = AS_NUMBER(op1);
-          auto v2 = AS_NUMBER(op2);
-          push(NUMBER(v1 + v2));
-        }
+  /**
+   * Executes a program (parsed in place, e.g. from a mapped file)
+   */
+  EvaValue exec(std::string_view program) {
+    HeapScope heapScope(&heap);
+    resetFibers();
+    startRun(true);
 
-        // String concaternation
-        if (IS_STRING(op1) && IS_STRING(op2)) {
-          auto s1 = AS_CPPSTRING(op1);
-          auto s2 = AS_CPPSTRING(op2);
-          push(ALLOC_STRING(s1 + s2));
-        }
-      } break;
+    // Each top-level form is compiled and run as soon as it's parsed,
+    // after a suspension the rest is kept for resume()
+    EvaValue result = BOOLEAN(false);
+    streamParser->parse(program,
+                        [&](const Exp &exp) { result = execOrDefer(exp); });
 
-      case OP_SUB:
-        BINARY_OP(-);
-        break;
+    flushOutput();
+    return result;
+  }
 
-      case OP_MUL:
-        BINARY_OP(*);
-        break;
+  /**
+   * Compiles a program without running it (globals it declares
+   * are defined), returns the code object
+   */
+  CodeObject *compile(std::string_view program) {
+    HeapScope heapScope(&heap);
+    compiler->beginIncremental();
 
-      case OP_DIV:
-        BINARY_OP(/);
-        break;
+    streamParser->parse(program, [&](const Exp &exp) {
+      try {
+        compiler->compileForm(exp);
+      } catch (EvaError &error) {
+        if (error.line == 0) {
+          error.line = streamParser->getFormLine();
+          error.column = streamParser->getFormColumn();
+        }
+        throw;
+      }
+    });
 
-        // -----------------------
-        // Comparison
-      case OP_COMPARE: {
-        auto op = READ_BYTE();
-        auto op2 = pop();
-        auto op1 = pop();
+    if (Policy::disassemble && disassemble) {
+      compiler->disassembleBytecode();
+    }
 
-        if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
-          auto v1 = AS_NUMBER(op1);
-          auto v2 = AS_NUMBER(op2);
-          COMPARE_VALUES(op, v1, v2);
-        } else if (IS_STRING(op1) && IS_STRING(op2)) {
-          auto s1 = AS_STRING(op1);
-          auto s2 = AS_STRING(op2);
-          COMPARE_VALUES(op, s1, s2);
-        }
-      } break;
+    return compiler->getCode();
+  }
 
-        // -----------------------
-        // Conditional jump
-      case OP_JMP_IF_ELSE: {
-        auto cond = AS_BOOLEAN(pop());
+  /**
+   * Executes a program read from a file descriptor in chunks
+   */
+  EvaValue execFd(int fd) {
+    HeapScope heapScope(&heap);
+    resetFibers();
+    startRun(true);
 
-        auto address = READ_SHORT();
+    EvaValue result = BOOLEAN(false);
+    streamParser->reset();
+    streamParser->parseFd(fd,
+                          [&](const Exp &exp) { result = execOrDefer(exp); });
 
-        if (!cond) {
-          ip = TO_ADDRESS(address);
-        }
-      } break;
+    flushOutput();
+    return result;
+  }
 
-        // -----------------------
-        // Unconditional jump
-      case OP_JMP: {
-        ip = TO_ADDRESS(READ_SHORT());
-      } break;
+  /**
+   * Resumes a suspended run with a new budget: finishes the suspended
+   * form, then runs the remaining ones (unless suspended again)
+   */
+  EvaValue resume() {
+    if (!suspended) {
+      DIE << "resume(): the VM is not suspended";
+    }
 
-      case OP_GET_GLOBAL: {
-        auto globalIndex = READ_BYTE();
-        push(global->get(globalIndex).value);
-      } break;
+    HeapScope heapScope(&heap);
+    startBudget(true);
 
-      case OP_SET_GLOBAL: {
-        auto globalIndex = READ_BYTE();
-        auto value = peek(0);
-        global->set(globalIndex, value);
-      } break;
+    EvaValue result;
+    try {
+      result = eval();
+    } catch (const EvaError &) {
+      resetFibers();
+      throw;
+    }
 
-      default:
-        DIE << "Unknown opcode: " << std::hex << (uint64_t)opcode;
-      }
+    while (!suspended && !pendingForms.empty()) {
+      auto exp = std::move(pendingForms.front());
+      pendingForms.pop_front();
+      result = runForm(exp);
     }
+
+    flushOutput();
+    return result;
   }
 
   /**
-   * Sets up global variables and functions
+   * Runs a form, or defers it while the run is suspended
    */
-  void setGlobalVariables() {
-    global->addConst("x", 10);
-    global->addConst("y", 20);
+  EvaValue execOrDefer(const Exp &exp) {
+    if (suspended) {
+      pendingForms.push_back(exp);
+      return BOOLEAN(false);
+    }
+    return execStreamedForm(exp);
   }
 
-public:
   /**
-   * Global object
+   * Executes a program, reporting errors as a result instead of
+   * throwing. The VM stays usable after an error.
    */
-  std::shared_ptr<Global> global;
+  EvaResult run(std::string_view program) {
+    return recover([&]() { return exec(program); });
+  }
 
-  /**
-   * Parser
-   */
-  std::unique_ptr<EvaParser> parser;
+  EvaResult runFd(int fd) {
+    return recover([&]() { return execFd(fd); });
+  }
 
-  /**
-   * Compiler
-   */
-  std::unique_ptr<EvaCompiler> compiler;
+  EvaResult runResume() {
+    return recover([&]() { return resume(); });
+  }
 
   /**
-   * Instruction pointer (aka Program counter)
+   * Runs an exec function, converting its error into a result
    */
-  uint8_t *ip;
+  template <typename ExecFn> EvaResult recover(ExecFn execFn) {
+    try {
+      auto value = execFn();
+      return {value, std::nullopt, suspended};
+    } catch (const EvaError &error) {
+      // Output printed before the error is written first
+      output.flush();
+      resetFibers();
+      streamParser->reset();
+      suspended = false;
+      pendingForms.clear();
+      return {BOOLEAN(false), error};
+    }
+  }
 
   /**
-   * Stack pointer
+   * Executes a program compiling its top-level forms in parallel
    */
-  EvaValue *sp;
+  EvaValue execParallel(std::string_view program, size_t threads = 0) {
+    HeapScope heapScope(&heap);
+
+    // 1. Parse all top-level forms
+    auto forms = parseForms(program);
+
+    // 2. Compile and link
+    enterCode(EvaParallelCompiler(global, profile).compile(forms, threads));
+    resetFibers();
+    startRun(false);
+
+    // Init the stack
+    initStack();
+
+    // Set instruction pointer to the beginning:
+    ip = &co->code[0];
+
+    auto result = eval();
+    flushOutput();
+    return result;
+  }
 
   /**
-   * Operands stack
+   * Compiles a program for batch evaluation. Inputs are globals
+   * (defined here if needed) rebound for each row.
    */
-  std::array<EvaValue, STACK_LIMIT> stack;
+  BatchProgram compileBatch(std::string_view program,
+                            const std::vector<std::string> &inputs) {
+    HeapScope heapScope(&heap);
+
+    BatchProgram batch;
+    for (const auto &name : inputs) {
+      global->define(name);
+      batch.inputs.push_back(global->getGlobalIndex(name));
+    }
+
+    batch.co =
+        EvaParallelCompiler(global, profile).compile(parseForms(program), 1);
+    return batch;
+  }
 
   /**
-   * Code object
+   * Evaluates a batch program for each row of the columns, results
+   * are stored by row (reusing the vector's capacity). Only the input
+   * globals are rebound per row, other globals persist.
    */
-  CodeObject *co;
+  void execBatch(const BatchProgram &batch, const BatchColumns &columns,
+                 std::vector<EvaValue> &results) {
+    if (columns.size() != batch.inputs.size()) {
+      DIE << "execBatch: expected " << batch.inputs.size() << " columns, got "
+          << columns.size();
+    }
+
+    auto rows = columns.empty() ? 0 : columns[0].size();
+    for (const auto &column : columns) {
+      if (column.size() != rows) {
+        DIE << "execBatch: columns have different lengths";
+      }
+    }
+
+    HeapScope heapScope(&heap);
+    resetFibers();
+    startRun(false);
+    enterCode(batch.co);
+    results.resize(rows);
+
+    for (size_t row = 0; row < rows; row++) {
+      for (size_t i = 0; i < columns.size(); i++) {
+        global->getMutable(batch.inputs[i]).value = columns[i][row];
+      }
+
+      initStack();
+      ip = &co->code[0];
+      results[row] = eval();
+    }
+
+    flushOutput();
+  }
+
+  std::vector<EvaValue> execBatch(const BatchProgram &batch,
+                                  const BatchColumns &columns) {
+    std::vector<EvaValue> results;
+    execBatch(batch, columns, results);
+    return results;
+  }
+
+  /**
+   * Compiles a program ahead of time into native code: the C++ source
+   * (soPath + ".cpp") is built into the shared object soPath, which is
+   * loaded. Use a new path while a previous program is loaded.
+   */
+  AotProgram compileAot(std::string_view program, const std::string &soPath) {
+    HeapScope heapScope(&heap);
+    auto co =
+        EvaParallelCompiler(global, profile).compile(parseForms(program), 1);
+
+    EvaAot aot;
+    aot.build(aot.translate(co, Policy::profile), soPath);
+    return aot.load(soPath, co);
+  }
+
+  /**
+   * Runs a native program (instead of eval), with the same results
+   * and effects on globals as interpreting its code object
+   */
+  EvaValue execAot(const AotProgram &program) {
+    HeapScope heapScope(&heap);
+    resetFibers();
+    startRun(false);
+    enterCode(program.co);
+    initStack();
+
+    // Globals by index (written ones are made private to this VM)
+    std::vector<EvaValue *> globals(global->size());
+    auto &code = co->code;
+    for (size_t offset = 0; offset < code.size();
+         offset += opcodeSize(code[offset])) {
+      auto opcode = code[offset];
+      auto read = opcode == OP_GET_GLOBAL || opcode == OP_GET_GLOBAL_WIDE;
+      if (read || opcode == OP_SET_GLOBAL || opcode == OP_SET_GLOBAL_WIDE ||
+          opcode == OP_FOR_STEP) {
+        auto index = getOperand(code, offset, 0);
+        if (index >= globals.size()) {
+          DIE << "Global " << index << " doesn't exist";
+        }
+        if (read && globals[index] != nullptr) {
+          continue;
+        }
+        globals[index] = read
+                             ? const_cast<EvaValue *>(&global->get(index).value)
+                             : &global->getMutable(index).value;
+      }
+    }
+
+    EvaAotContext ctx{sp,
+                      stackBase,
+                      stackLimit,
+                      co->constants.data(),
+                      globals.data(),
+                      loopCounters,
+                      branchCounters,
+                      instructions,
+                      jumps,
+                      fuelCheck,
+                      this,
+                      aotStep,
+                      aotOutOfFuel,
+                      aotError};
+
+    auto result = program.entry(&ctx);
+    sp = ctx.sp;
+    instructions = ctx.instructions;
+    jumps = ctx.jumps;
+    flushOutput();
+    return result;
+  }
+
+  /**
+   * Compiles a top-level form into its own code object, and runs it.
+   * Used directly by a REPL to evaluate line by line.
+   */
+  EvaValue execForm(const Exp &exp) {
+    auto result = runForm(exp);
+    flushOutput();
+    return result;
+  }
+
+  /**
+   * Runs a form (see execForm), its output may still be buffered
+   */
+  EvaValue runForm(const Exp &exp) {
+    HeapScope heapScope(&heap);
+
+    // 1. Compile the form to Eva bytecode
+    enterCode(compiler->compileStreamed(exp));
+
+    // Debug disassembly
+    if (Policy::disassemble && disassemble) {
+      compiler->disassembleBytecode();
+    }
+
+    // Init the stack
+    initStack();
+
+    // Set instruction pointer to the beginning:
+    ip = &co->code[0];
+
+    try {
+      return eval();
+    } catch (const EvaError &) {
+      // Fibers of the failed form are abandoned
+      resetFibers();
+      throw;
+    }
+  }
+
+  /**
+   * Runs a form of the stream parser, errors get the form's position
+   */
+  EvaValue execStreamedForm(const Exp &exp) {
+    try {
+      return runForm(exp);
+    } catch (EvaError &error) {
+      if (error.line == 0) {
+        error.line = streamParser->getFormLine();
+        error.column = streamParser->getFormColumn();
+      }
+      throw;
+    }
+  }
+
+  /**
+   * Calls a callable, arguments are its locals 0..argc-1
+   */
+  EvaValue call(CodeObject *callable, const EvaValue *args, size_t argc) {
+    // Each call is a budget checkpoint, the callable may have no loop
+    // (only workers call, they can't suspend: this check aborts)
+    if (instructions >= fuelCheck) {
+      outOfFuel();
+    }
+
+    if (co != callable) {
+      enterCode(callable);
+    }
+    initStack();
+
+    for (size_t i = 0; i < argc; i++) {
+      push(args[i]);
+    }
+
+    ip = &co->code[0];
+
+    return eval();
+  }
+
+  /**
+   * Main eval lopp (Step: runs one instruction, for native code)
+   */
+  template <bool Step = false> EvaValue eval() {
+#ifdef EVA_WIDE_CODE
+    uint32_t instruction;
+#endif
+    for (;;) {
+      auto opcode = READ_OPCODE();
+      instructions++;
+
+      if constexpr (Policy::trace) {
+        if (trace) {
+          traceInstruction(opcode);
+        }
+      }
+
+      switch (opcode) {
+      case OP_HALT:
+        // The main fiber waits for all spawned ones
+        if (fibers.liveCount() > 1) {
+          if (!fibers.hasRunnable()) {
+            DIE << "Deadlock: all fibers are blocked in join";
+          }
+          ip -= CODE_UNIT;
+          switchFiber();
+          break;
+        }
+        return pop();
+
+        // ---------------
+        // Constants:
+      case OP_CONST:
+        push(GET_CONST());
+        break;
+
+      case OP_CONST_WIDE:
+        push(co->constants[READ_OPERAND_SHORT()]);
+        break;
+
+        // ---------------
+        // Math ops:
+      case OP_ADD: {
+
+        auto op2 = pop();
+        auto op1 = pop();
+
+        /// Integer addition (promotes to double on overflow)
+        if (IS_INT(op1) && IS_INT(op2)) {
+          int64_t res;
+          if (!__builtin_add_overflow(AS_INT(op1), AS_INT(op2), &res)) {
+            push(INT(res));
+          } else {
+            push(NUMBER(AS_DOUBLE(op1) + AS_DOUBLE(op2)));
+          }
+        }
+
+        /// Numeric addition
+        else if (IS_NUMERIC(op1) && IS_NUMERIC(op2)) {
+          auto v1 = AS_DOUBLE(op1);
+          auto v2 = AS_DOUBLE(op2);
+          push(NUMBER(v1 + v2));
+        }
+
+        // String concaternation
+        else if (IS_STRING(op1) && IS_STRING(op2)) {
+          auto s1 = AS_CPPSTRING(op1);
+          auto s2 = AS_CPPSTRING(op2);
+          push(ALLOC_STRING(s1, s2));
+        }
+
+        else {
+          DIE << "+: expected numbers or strings, got: " << op1 << ", " << op2;
+        }
+      } break;
+
+      case OP_SUB:
+        INT_BINARY_OP(-, __builtin_sub_overflow);
+        break;
+
+      case OP_MUL:
+        INT_BINARY_OP(*, __builtin_mul_overflow);
+        break;
+
+      case OP_DIV:
+        BINARY_OP(/);
+        break;
+
+        // -----------------------
+        // Comparison
+      case OP_COMPARE: {
+        auto op = READ_OPERAND();
+        auto op2 = pop();
+        auto op1 = pop();
+
+        if (IS_INT(op1) && IS_INT(op2)) {
+          auto v1 = AS_INT(op1);
+          auto v2 = AS_INT(op2);
+          COMPARE_VALUES(op, v1, v2);
+        } else if (IS_NUMERIC(op1) && IS_NUMERIC(op2)) {
+          auto v1 = AS_DOUBLE(op1);
+          auto v2 = AS_DOUBLE(op2);
+          COMPARE_VALUES(op, v1, v2);
+        } else if (IS_STRING(op1) && IS_STRING(op2)) {
+          auto s1 = AS_CPPSTRING(op1);
+          auto s2 = AS_CPPSTRING(op2);
+          COMPARE_VALUES(op, s1, s2);
+        } else {
+          DIE << "compare: expected numbers or strings, got: " << op1 << ", "
+              << op2;
+        }
+      } break;
+
+        // -----------------------
+        // Conditional jump
+      case OP_JMP_IF_ELSE:
+      case OP_JMP_IF_TRUE: {
+        auto cond = AS_BOOLEAN(pop());
+
+        auto address = READ_ADDRESS();
+        auto branch = READ_NEXT_OPERAND();
+        if constexpr (Policy::profile) {
+          branchCounters[2 * branch + cond]++;
+        }
+
+        if (cond == (opcode == OP_JMP_IF_TRUE)) {
+          if constexpr (Policy::profile) {
+            jumps++;
+          }
+          ip = TO_ADDRESS(address);
+        }
+      } break;
+
+        // -----------------------
+        // Unconditional jump
+      case OP_JMP: {
+        if constexpr (Policy::profile) {
+          jumps++;
+        }
+        ip = TO_ADDRESS(READ_ADDRESS());
+      } break;
+
+      case OP_GET_GLOBAL: {
+        auto globalIndex = READ_OPERAND();
+        push(global->get(globalIndex).value);
+      } break;
+
+      case OP_SET_GLOBAL: {
+        auto globalIndex = READ_OPERAND();
+        auto value = peek(0);
+        global->set(globalIndex, value);
+      } break;
+
+      case OP_GET_GLOBAL_WIDE:
+        push(global->get(READ_OPERAND_SHORT()).value);
+        break;
+
+      case OP_SET_GLOBAL_WIDE:
+        global->set(READ_OPERAND_SHORT(), peek(0));
+        break;
+
+      case OP_POP:
+        pop();
+        break;
+
+        // -----------------------
+        // Maps
+      case OP_MAP_NEW: {
+        auto pairs = READ_OPERAND();
+        auto map = ALLOC_MAP();
+        auto entries = sp - 2 * pairs;
+        for (auto i = 0; i < pairs; i++) {
+          AS_MAP(map)->set(entries[2 * i], entries[2 * i + 1]);
+        }
+        sp = entries;
+        push(map);
+      } break;
+
+      case OP_MAP_GET: {
+        auto key = pop();
+        auto map = popMap();
+        auto value = map->get(key);
+        if (value == nullptr) {
+          DIE << "map-get: key not found: " << key;
+        }
+        push(*value);
+      } break;
+
+      case OP_MAP_SET: {
+        auto value = pop();
+        auto key = pop();
+        popMutableMap()->set(key, value);
+        push(value);
+      } break;
+
+      case OP_MAP_HAS: {
+        auto key = pop();
+        push(BOOLEAN(popMap()->has(key)));
+      } break;
+
+      case OP_MAP_DELETE: {
+        auto key = pop();
+        push(BOOLEAN(popMutableMap()->remove(key)));
+      } break;
+
+        // -----------------------
+        // Instances
+      case OP_NEW_INSTANCE:
+        push(ALLOC_INSTANCE(READ_OPERAND()));
+        break;
+
+      case OP_GET_PROP: {
+        auto &cache = co->propertyCaches[READ_OPERAND_SHORT()];
+        auto instance = popInstance();
+        auto entry = probeCache(cache, instance->shape);
+        push(entry != nullptr ? instance->slots[entry->slot]
+                              : getProperty(instance, cache));
+      } break;
+
+      case OP_SET_PROP: {
+        auto &cache = co->propertyCaches[READ_OPERAND_SHORT()];
+        auto value = pop();
+        setProperty(popMutableInstance(), cache, value);
+        push(value);
+      } break;
+
+      case OP_INIT_PROP: {
+        auto &cache = co->propertyCaches[READ_OPERAND_SHORT()];
+        auto value = pop();
+        setProperty(AS_INSTANCE(peek()), cache, value);
+      } break;
+
+        // -----------------------
+        // Fibers
+      case OP_SPAWN: {
+        auto address = READ_ADDRESS();
+        auto id = fibers.spawn(ip);
+        ip = TO_ADDRESS(address);
+        push(INT((int64_t)id));
+      } break;
+
+      case OP_YIELD:
+        push(BOOLEAN(false));
+        switchFiber();
+        break;
+
+      case OP_JOIN: {
+        auto handle = pop();
+        if (!IS_INT(handle)) {
+          DIE << "join: expected a fiber, got: " << handle;
+        }
+        auto fiber = fibers.get(AS_INT(handle));
+
+        if (fiber->state == FiberState::DONE) {
+          push(fiber->result);
+          break;
+        }
+
+        // Block, and re-run the join when woken up
+        push(handle);
+        ip -= CODE_UNIT;
+        fibers.waitFor(AS_INT(handle));
+        switchFiber();
+      } break;
+
+      case OP_FIBER_END:
+        fibers.finish(pop());
+        switchFiber();
+        break;
+
+      case OP_GET_LOCAL:
+        push(stackBase[READ_OPERAND()]);
+        break;
+
+        // -----------------------
+        // Loops
+      case OP_LOOP: {
+        auto address = READ_ADDRESS();
+        auto loop = READ_NEXT_OPERAND();
+        if constexpr (Policy::profile) {
+          loopCounters[loop]++;
+        }
+        ip = TO_ADDRESS(address);
+        CHECK_FUEL();
+      } break;
+
+      case OP_FOR_STEP: {
+        auto &counter = global->getMutable(READ_OPERAND_SHORT()).value;
+        auto address = READ_NEXT_OPERAND();
+        auto loop = READ_NEXT_OPERAND();
+        auto end = peek(0);
+
+        bool next;
+        int64_t res;
+        if (IS_INT(counter) && IS_INT(end) &&
+            !__builtin_add_overflow(AS_INT(counter), 1, &res)) {
+          counter = INT(res);
+          next = res < AS_INT(end);
+        } else if (IS_NUMERIC(counter) && IS_NUMERIC(end)) {
+          counter = NUMBER(AS_DOUBLE(counter) + 1);
+          next = AS_NUMBER(counter) < AS_DOUBLE(end);
+        } else {
+          DIE << "for: expected numbers, got: " << counter << ", " << end;
+        }
+
+        if (next) {
+          if constexpr (Policy::profile) {
+            loopCounters[loop]++;
+          }
+          ip = TO_ADDRESS(address);
+          CHECK_FUEL();
+        }
+      } break;
+
+        // -----------------------
+        // String builtins
+      case OP_STRING:
+        stringBuiltin(READ_OPERAND());
+        break;
+
+        // -----------------------
+        // Output
+      case OP_PRINT: {
+        auto count = READ_OPERAND();
+        printValues(sp - count, count);
+        sp -= count;
+        push(BOOLEAN(false));
+      } break;
+
+        // -----------------------
+        // Parallel builtins
+      case OP_PMAP: {
+        auto callable = AS_CODE(pop());
+        auto input = pop();
+        push(parallelMap(callable, input));
+      } break;
+
+      case OP_PREDUCE: {
+        auto callable = AS_CODE(pop());
+        auto init = pop();
+        auto input = pop();
+        push(parallelReduce(callable, input, init));
+      } break;
+
+      default:
+        if constexpr (Policy::checkOpcodes) {
+          DIE << "Unknown opcode: " << std::hex << (uint64_t)opcode;
+        } else {
+          __builtin_unreachable();
+        }
+      }
+
+      if constexpr (Step) {
+        return BOOLEAN(true);
+      }
+    }
+  }
+
+  /**
+   * Runs a string builtin on its arguments (see eva_string.h)
+   */
+  void stringBuiltin(size_t builtin) {
+    switch (builtin) {
+    case STRING_SUBSTRING: {
+      auto end = popInt();
+      auto start = popInt();
+      push(substring(popString(), start, end));
+    } break;
+
+    case STRING_FIND: {
+      auto needle = popString();
+      push(INT(stringFind(popString(), needle)));
+    } break;
+
+    case STRING_SPLIT: {
+      auto separator = popString();
+      push(stringSplit(popString(), separator));
+    } break;
+
+    case STRING_TRIM:
+      push(stringTrim(popString()));
+      break;
+
+    case STRING_LENGTH:
+      push(INT((int64_t)popString()->length));
+      break;
+
+    default:
+      DIE << "Unknown string builtin: " << builtin;
+    }
+  }
+
+  /**
+   * Prints the values as a line: separated by spaces, strings
+   * without quotes
+   */
+  void printValues(const EvaValue *values, size_t count) {
+    printLine.clear();
+    for (size_t i = 0; i < count; i++) {
+      if (i > 0) {
+        printLine += ' ';
+      }
+      if (IS_STRING(values[i])) {
+        printLine += AS_CPPSTRING(values[i]);
+      } else if (IS_INT(values[i])) {
+        char digits[24];
+        auto end = std::to_chars(digits, digits + sizeof(digits),
+                                 AS_INT(values[i]));
+        printLine.append(digits, end.ptr);
+      } else {
+        printLine += evaValueToConstantString(values[i]);
+      }
+    }
+    printLine += '\n';
+    output.write(printLine);
+  }
+
+  /**
+   * Native code calls (see eva_aot_abi.h)
+   */
+  static size_t aotStep(EvaAotContext *ctx, size_t address) {
+    auto vm = (EvaVM *)ctx->vm;
+    vm->sp = ctx->sp;
+    vm->instructions = ctx->instructions;
+    vm->ip = &vm->co->code[address * CODE_UNIT];
+
+    vm->template eval<true>();
+
+    ctx->sp = vm->sp;
+    ctx->instructions = vm->instructions;
+    ctx->fuelCheck = vm->fuelCheck;
+    return (vm->ip - &vm->co->code[0]) / CODE_UNIT;
+  }
+
+  static void aotOutOfFuel(EvaAotContext *ctx) {
+    auto vm = (EvaVM *)ctx->vm;
+    vm->instructions = ctx->instructions;
+    vm->outOfFuel();
+    ctx->fuelCheck = vm->fuelCheck;
+  }
+
+  static void aotError(EvaAotContext *, const char *message) {
+    DIE << message;
+  }
+
+  /**
+   * Parses all top-level forms of a program
+   */
+  std::vector<Exp> parseForms(std::string_view program) {
+    std::vector<Exp> forms;
+    streamParser->parse(program,
+                        [&](const Exp &exp) { forms.push_back(exp); });
+    return forms;
+  }
+
+  /**
+   * Prints an instruction about to run: code object, address,
+   * opcode, and stack depth
+   */
+  void traceInstruction(uint8_t opcode) {
+    auto address = (ip - &co->code[0]) / CODE_UNIT - 1;
+    std::cerr << co->name << "@" << std::uppercase << std::hex
+              << std::setfill('0') << std::setw(4) << address << std::dec
+              << " " << opcodeToString(opcode) << " [" << (sp - stackBase)
+              << "]\n";
+  }
+
+  /**
+   * Switches to a code object, and its back-edge and branch counters
+   * (code without loops or branches, e.g. most streamed forms, gets
+   * no counters)
+   */
+  void enterCode(CodeObject *code) {
+    co = code;
+    loopCounters = nullptr;
+    branchCounters = nullptr;
+
+    if (!code->loops.empty()) {
+      auto &counters = backEdges[code];
+      counters.resize(code->loops.size());
+      loopCounters = counters.data();
+    }
+
+    if (!code->branches.empty()) {
+      auto &outcomes = branchOutcomes[code];
+      outcomes.resize(2 * code->branches.size());
+      branchCounters = outcomes.data();
+    }
+  }
+
+  /**
+   * Loops with at least `threshold` back-edges taken (including by
+   * worker VMs), hottest first. Empty if the policy has no counters.
+   */
+  std::vector<HotLoop> hotLoops(uint64_t threshold = 1) const {
+    std::map<std::pair<CodeObject *, size_t>, uint64_t> counts;
+
+    auto collect = [&](const EvaVM &vm) {
+      for (auto &[code, counters] : vm.backEdges) {
+        for (size_t i = 0; i < counters.size(); i++) {
+          counts[{code, i}] += counters[i];
+        }
+      }
+    };
+
+    collect(*this);
+    for (auto &worker : workers) {
+      collect(*worker);
+    }
+
+    std::vector<HotLoop> loops;
+    for (auto &[loop, count] : counts) {
+      if (count >= threshold) {
+        loops.push_back({loop.first, loop.first->loops[loop.second], count});
+      }
+    }
+
+    std::sort(loops.begin(), loops.end(), [](auto &a, auto &b) {
+      return a.backEdges > b.backEdges;
+    });
+    return loops;
+  }
+
+  /**
+   * Branch outcomes counted so far (including by worker VMs), all
+   * zero if the policy has no counters
+   */
+  BranchProfile branchProfile() const {
+    BranchProfile merged;
+
+    auto collect = [&](const EvaVM &vm) {
+      for (auto &[code, outcomes] : vm.branchOutcomes) {
+        for (size_t i = 0; i < code->branches.size(); i++) {
+          merged.add(code->branches[i], outcomes[2 * i], outcomes[2 * i + 1]);
+        }
+      }
+    };
+
+    collect(*this);
+    for (auto &worker : workers) {
+      collect(*worker);
+    }
+    return merged;
+  }
+
+  /**
+   * Writes the branch profile, for a later compilation (see loadProfile)
+   */
+  void saveProfile(const std::string &path) const {
+    if constexpr (!Policy::profile) {
+      DIE << "Branch counters are not compiled into this VM";
+    }
+    branchProfile().save(path);
+  }
+
+  /**
+   * Lays out `if` forms compiled from now on by the profile: the
+   * likely branch falls through, the other is moved out of line
+   */
+  void loadProfile(const std::string &path) {
+    setProfile(std::make_shared<BranchProfile>(BranchProfile::load(path)));
+  }
+
+  void setProfile(std::shared_ptr<const BranchProfile> branchProfile) {
+    profile = std::move(branchProfile);
+    compiler->setProfile(profile);
+  }
+
+  /**
+   * Starts a program with only the main fiber (ids of fibers
+   * spawned by a previous program are no longer valid)
+   */
+  void resetFibers() { fibers.reset(stack.data(), STACK_LIMIT); }
+
+  /**
+   * Inits the stack of the main fiber. All spawned fibers are done
+   * by the end of a form, so the main one is running.
+   */
+  void initStack() {
+    sp = &stack[0];
+    stackBase = &stack[0];
+    stackLimit = stackBase + STACK_LIMIT;
+  }
+
+  /**
+   * Saves registers of the running fiber, and switches to the next one
+   */
+  void switchFiber() {
+    auto fiber = fibers.running();
+    fiber->ip = ip;
+    fiber->sp = sp;
+
+    fiber = fibers.next();
+    if (fiber == nullptr) {
+      DIE << "Deadlock: all fibers are blocked in join";
+    }
+
+    ip = fiber->ip;
+    sp = fiber->sp;
+    stackBase = fiber->stackBase;
+    stackLimit = fiber->stackLimit;
+  }
+
+  /**
+   * Compiles a lazy callable before its first call (on this VM,
+   * workers only run it)
+   */
+  void prepareCallable(CodeObject *callable) {
+    if (callable->lazy != nullptr) {
+      compiler->compileLazy(callable);
+    }
+  }
+
+  /**
+   * Maps a callable over the input in parallel, results are
+   * an array-like map in input order
+   */
+  EvaValue parallelMap(CodeObject *callable, const EvaValue &input) {
+    prepareCallable(callable);
+    auto items = parallelInput(input);
+    std::vector<EvaValue> results(items.size());
+
+    runParallel(items.size(), [&](EvaVM &worker, size_t from, size_t to) {
+      for (auto i = from; i < to; i++) {
+        results[i] = worker.call(callable, &items[i], 1);
+      }
+    });
+
+    auto map = ALLOC_MAP();
+    for (size_t i = 0; i < results.size(); i++) {
+      AS_MAP(map)->set(INT((int64_t)i), results[i]);
+    }
+    return map;
+  }
+
+  /**
+   * Reduces the input with an associative callable (acc, x) in
+   * parallel: chunks are folded by workers, partial results are
+   * then folded in order starting from init.
+   */
+  EvaValue parallelReduce(CodeObject *callable, const EvaValue &input,
+                          const EvaValue &init) {
+    prepareCallable(callable);
+    auto items = parallelInput(input);
+    auto chunks = (items.size() + PARALLEL_CHUNK_SIZE - 1) /
+                  PARALLEL_CHUNK_SIZE;
+    std::vector<EvaValue> partials(chunks);
+
+    runParallel(items.size(), [&](EvaVM &worker, size_t from, size_t to) {
+      EvaValue args[2] = {items[from]};
+      for (auto i = from + 1; i < to; i++) {
+        args[1] = items[i];
+        args[0] = worker.call(callable, args, 2);
+      }
+      partials[from / PARALLEL_CHUNK_SIZE] = args[0];
+    });
+
+    EvaValue args[2] = {init};
+    try {
+      for (auto &partial : partials) {
+        args[1] = partial;
+        args[0] = workers[0]->call(callable, args, 2);
+      }
+    } catch (...) {
+      collectWorkerInstructions();
+      throw;
+    }
+    collectWorkerInstructions();
+    return args[0];
+  }
+
+  /**
+   * Items of a parallel builtin input: an array-like map
+   * (keys 0..N-1), or a count N (range 0..N-1)
+   */
+  std::vector<EvaValue> parallelInput(const EvaValue &input) {
+    std::vector<EvaValue> items;
+
+    if (IS_INT(input)) {
+      for (int64_t i = 0; i < AS_INT(input); i++) {
+        items.push_back(INT(i));
+      }
+    } else if (IS_MAP(input)) {
+      auto map = AS_MAP(input);
+      items.reserve(map->count());
+      for (size_t i = 0; i < map->count(); i++) {
+        auto value = map->get(INT((int64_t)i));
+        if (value == nullptr) {
+          DIE << "Parallel input: expected keys 0.." << map->count() - 1
+              << ", missing " << i;
+        }
+        items.push_back(*value);
+      }
+    } else {
+      DIE << "Parallel input: expected a map or a count, got: " << input;
+    }
+
+    return items;
+  }
+
+  /**
+   * Runs chunks of [0, count) on the work-stealing pool of worker VMs
+   */
+  template <typename ChunkFn> void runParallel(size_t count, ChunkFn fn) {
+    auto threads = parallelThreads != 0
+                       ? parallelThreads
+                       : std::max(1u, std::thread::hardware_concurrency());
+
+    // At least one worker (also folds the partials of reduce)
+    while (workers.size() < threads) {
+      workers.push_back(std::make_unique<EvaVM>(global));
+    }
+
+    auto chunks = (count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+
+    // Workers charge the heap, and share the budget of this VM
+    auto heapOwner = &heap;
+    workerFuel = fuelLimit - std::min(fuelLimit, instructions);
+    for (auto &worker : workers) {
+      worker->inheritBudget(*this);
+    }
+
+    try {
+      workPool.run(chunks, threads, [&](size_t worker, size_t chunk) {
+        HeapScope heapScope(heapOwner);
+        auto from = chunk * PARALLEL_CHUNK_SIZE;
+        auto to = std::min(count, from + PARALLEL_CHUNK_SIZE);
+        fn(*workers[worker], from, to);
+      });
+    } catch (...) {
+      // Instructions run before a worker failed (e.g. out of budget)
+      // are counted too
+      collectWorkerInstructions();
+      throw;
+    }
+    collectWorkerInstructions();
+  }
+
+  /**
+   * Adds instructions (and jumps) run by workers to this VM's count
+   */
+  void collectWorkerInstructions() {
+    for (auto &worker : workers) {
+      instructions += worker->instructions;
+      jumps += worker->jumps;
+      worker->instructions = 0;
+      worker->jumps = 0;
+    }
+  }
+
+  /**
+   * Sets the budget of each run (exec, batch, resume)
+   */
+  void setBudget(const Budget &newBudget) { budget = newBudget; }
+
+  /**
+   * Instructions executed by the last run (including parallel
+   * workers), e.g. for billing
+   */
+  uint64_t instructionCount() const { return instructions; }
+
+  /**
+   * Jumps taken by the last run (fewer with a profiled layout), 0 if
+   * the policy has no counters
+   */
+  uint64_t jumpCount() const { return jumps; }
+
+  /**
+   * Whether the last run ran out of budget, and can be resumed
+   */
+  bool isSuspended() const { return suspended; }
+
+  /**
+   * Starts a new run, dropping a suspended one
+   */
+  void startRun(bool canSuspend) {
+    pendingForms.clear();
+    startBudget(canSuspend);
+  }
+
+  /**
+   * Starts the budget of a run (suspension only where it can be
+   * resumed: streamed programs)
+   */
+  void startBudget(bool canSuspend) {
+    suspended = false;
+    suspendable = canSuspend;
+    instructions = 0;
+    jumps = 0;
+    fuelLimit = budget.instructions;
+    deadline = std::chrono::steady_clock::now() + budget.time;
+    fuelCheck = nextFuelCheck();
+  }
+
+  /**
+   * Worker budget: instructions are drawn in slices from the fuel
+   * left to the parent's workers (shared by all of them), aborts when
+   * it's out. Workers of a worker draw from the same fuel.
+   */
+  void inheritBudget(EvaVM &parent) {
+    budget = parent.budget;
+    suspended = false;
+    suspendable = false;
+    instructions = 0;
+    jumps = 0;
+    sharedFuel = parent.fuelLimit == 0         ? nullptr
+                 : parent.sharedFuel != nullptr ? parent.sharedFuel
+                                                : &parent.workerFuel;
+
+    // The first check draws a slice
+    fuelLimit = sharedFuel != nullptr ? 1 : 0;
+    deadline = parent.deadline;
+    fuelCheck = nextFuelCheck();
+  }
+
+  /**
+   * Draws a slice of the shared fuel into the limit of this worker,
+   * returns false if none is left
+   */
+  bool refuel() {
+    if (sharedFuel == nullptr) {
+      return false;
+    }
+    auto left = sharedFuel->load(std::memory_order_relaxed);
+    uint64_t slice;
+    do {
+      slice = std::min<uint64_t>(left, FUEL_SLICE);
+      if (slice == 0) {
+        return false;
+      }
+    } while (!sharedFuel->compare_exchange_weak(left, left - slice,
+                                                std::memory_order_relaxed));
+    fuelLimit = instructions + slice;
+    return true;
+  }
+
+  /**
+   * Instruction count of the next budget check
+   */
+  uint64_t nextFuelCheck() {
+    uint64_t check = fuelLimit != 0 ? fuelLimit : UINT64_MAX;
+    if (budget.time.count() != 0) {
+      check = std::min(check, instructions + FUEL_CLOCK_INTERVAL);
+    }
+    return check;
+  }
+
+  /**
+   * Budget check (slow path): returns true if the run suspends,
+   * throws if it aborts
+   */
+  bool outOfFuel() {
+    auto exhausted =
+        (fuelLimit != 0 && instructions >= fuelLimit && !refuel()) ||
+        (budget.time.count() != 0 &&
+         std::chrono::steady_clock::now() >= deadline);
+
+    if (!exhausted) {
+      fuelCheck = nextFuelCheck();
+      return false;
+    }
+
+    if (budget.policy == FuelPolicy::SUSPEND && suspendable) {
+      suspended = true;
+      return true;
+    }
+
+    throw EvaError("run exceeded its budget after " +
+                       std::to_string(instructions) + " instructions",
+                   EvaErrorKind::BUDGET);
+  }
+
+  /**
+   * Threads of parallel builtins (0: hardware concurrency)
+   */
+  void setParallelThreads(size_t threads) { parallelThreads = threads; }
+
+  /**
+   * Sets the hard heap limit in bytes (0 is unlimited). Exceeding it
+   * aborts the running script with HeapLimitError (an EvaError).
+   */
+  void setHeapLimit(size_t bytes) { heap.setLimit(bytes); }
+
+  /**
+   * Heap accounting stats
+   */
+  HeapStats heapStats() const { return heap.stats(); }
+
+  /**
+   * Writes `print` output to the file descriptor (stdout by default)
+   */
+  void setOutput(int fd) {
+    if (auto error = output.setFd(fd)) {
+      DIE << "print: can't write the output: " << strerror(error);
+    }
+  }
+
+  /**
+   * Waits until all printed output is written (done when a run
+   * returns: exec, execFd, execBatch, ...)
+   */
+  void flushOutput() {
+    if (auto error = output.flush()) {
+      DIE << "print: can't write the output: " << strerror(error);
+    }
+  }
+
+  /**
+   * Output stats (bytes printed, writes, backpressure stalls)
+   */
+  OutputStats outputStats() const { return output.stats(); }
+
+  /**
+   * Prints the disassembly of each program (exec, compile) to stdout
+   */
+  void setDisassemble(bool enabled) { disassemble = enabled; }
+
+  /**
+   * Traces each executed instruction to stderr (if the policy has
+   * tracing, otherwise it's an error)
+   */
+  void setTrace(bool enabled) {
+    if constexpr (!Policy::trace) {
+      DIE << "Tracing is not compiled into this VM";
+    }
+    trace = enabled;
+  }
+
+  /**
+   * Marks objects reachable from the value frozen, interns strings
+   */
+  void freezeValue(const EvaValue &value, FrozenTable &table) {
+    if (!IS_OBJECT(value) || AS_OBJECT(value)->frozen) {
+      return;
+    }
+
+    auto object = AS_OBJECT(value);
+    object->frozen = true;
+
+    switch (object->type) {
+    case ObjectType::STRING: {
+      auto str = (StringObject *)object;
+      table.strings.emplace(str->view(), str);
+      if (str->parent != nullptr) {
+        freezeValue({.type = EvaValueType::OBJECT, .object = str->parent},
+                    table);
+      }
+    } break;
+    case ObjectType::CODE:
+      for (auto &constant : ((CodeObject *)object)->constants) {
+        freezeValue(constant, table);
+      }
+      break;
+    case ObjectType::MAP:
+      ((MapObject *)object)->forEach([&](auto &key, auto &value) {
+        freezeValue(key, table);
+        freezeValue(value, table);
+      });
+      break;
+    case ObjectType::INSTANCE:
+      for (auto &value : ((InstanceObject *)object)->slots) {
+        freezeValue(value, table);
+      }
+      break;
+    }
+  }
+
+  /**
+   * Sets up global variables and functions
+   */
+  void setGlobalVariables() {
+    global->addConst("x", INT(10));
+    global->addConst("y", INT(20));
+  }
+
+public:
+  /**
+   * Heap accounting (declared first: objects are charged
+   * from the very first allocation)
+   */
+  EvaHeap heap;
+
+  /**
+   * Buffered output of print, and its line being formatted
+   */
+  EvaOutput output;
+  std::string printLine;
+
+  /**
+   * Global object
+   */
+  std::shared_ptr<Global> global;
+
+  /**
+   * Parser
+   */
+  std::unique_ptr<EvaParser> parser;
+
+  /**
+   * Streaming front end (top-level forms)
+   */
+  std::unique_ptr<EvaStreamParser> streamParser;
+
+  /**
+   * Compiler
+   */
+  std::unique_ptr<EvaCompiler<Policy>> compiler;
+
+  /**
+   * Instruction pointer (aka Program counter)
+   */
+  uint8_t *ip;
+
+  /**
+   * Stack pointer
+   */
+  EvaValue *sp;
+
+  /**
+   * Bounds of the running fiber's stack
+   */
+  EvaValue *stackBase;
+  EvaValue *stackLimit;
+
+  /**
+   * Operands stack (of the main fiber)
+   */
+  std::array<EvaValue, STACK_LIMIT> stack;
+
+  /**
+   * Fibers scheduler
+   */
+  FiberScheduler fibers;
+
+  /**
+   * Worker VMs and pool of parallel builtins
+   */
+  std::vector<std::unique_ptr<EvaVM>> workers;
+  WorkStealingPool workPool;
+  size_t parallelThreads = 0;
+
+  /**
+   * Budget, and instructions executed by the current run
+   */
+  Budget budget;
+  uint64_t instructions = 0;
+
+  /**
+   * Instruction limit (0 is unlimited) and deadline of the run,
+   * instruction count of the next check
+   */
+  uint64_t fuelLimit = 0;
+  std::chrono::steady_clock::time_point deadline;
+  uint64_t fuelCheck = UINT64_MAX;
+
+  /**
+   * Fuel left to the workers of a parallel builtin, and the shared
+   * fuel a worker draws from (nullptr: unlimited, or not a worker)
+   */
+  std::atomic<uint64_t> workerFuel{0};
+  std::atomic<uint64_t> *sharedFuel = nullptr;
+
+  /**
+   * Suspended run, and forms not yet run
+   */
+  bool suspended = false;
+  bool suspendable = false;
+  std::deque<Exp> pendingForms;
+
+  /**
+   * Debug disassembly of programs
+   */
+  bool disassemble = true;
+
+  /**
+   * Instruction trace
+   */
+  bool trace = false;
+
+  /**
+   * Code object
+   */
+  CodeObject *co = nullptr;
+
+  /**
+   * Back-edge counters of the running code object, by loop index
+   */
+  uint64_t *loopCounters;
+
+  /**
+   * Back-edge counters by code object
+   */
+  std::unordered_map<CodeObject *, std::vector<uint64_t>> backEdges;
+
+  /**
+   * Outcome counters of the running code object: false and true
+   * count of each branch (by branch index)
+   */
+  uint64_t *branchCounters;
+
+  /**
+   * Outcome counters by code object
+   */
+  std::unordered_map<CodeObject *, std::vector<uint64_t>> branchOutcomes;
+
+  /**
+   * Jumps taken by the current run
+   */
+  uint64_t jumps = 0;
+
+  /**
+   * Branch profile guiding the compilers (nullptr: none)
+   */
+  std::shared_ptr<const BranchProfile> profile;
 };
 
 #endif
@@ -0,0 +1,199 @@
+/**
+ * Work-stealing pool
+ *
+ * Runs a fixed set of tasks (chunks of an input) on a pool of threads.
+ * Each worker starts with a contiguous range of chunks in its own deque,
+ * takes work from the front, and when out of work steals from the back
+ * of other workers' deques.
+ *
+ * The calling thread is worker 0. Helper threads are started on the
+ * first run which needs them, and park between runs until the pool
+ * is destroyed.
+ */
+
+#ifndef EVA_WORK_POOL__H
+#define EVA_WORK_POOL__H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Task: (worker index, chunk index)
+ */
+using ChunkTask = std::function<void(size_t, size_t)>;
+
+class WorkStealingPool {
+public:
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto &helper : helpers) {
+      helper.join();
+    }
+  }
+
+  /**
+   * Runs task for chunks [0, chunks) on up to `threads` workers,
+   * returns when all are done. The first exception thrown by a task
+   * is rethrown on the calling thread.
+   */
+  void run(size_t chunks, size_t threads, const ChunkTask &task) {
+    threads = std::max<size_t>(1, std::min(threads, chunks));
+
+    queues = std::vector<WorkQueue>(threads);
+    for (size_t i = 0; i < threads; i++) {
+      auto from = chunks * i / threads;
+      auto to = chunks * (i + 1) / threads;
+      for (auto chunk = from; chunk < to; chunk++) {
+        queues[i].chunks.push_back(chunk);
+      }
+    }
+
+    error = nullptr;
+
+    while (helpers.size() < threads - 1) {
+      auto worker = helpers.size() + 1;
+      helpers.emplace_back([this, worker, seen = generation]() {
+        park(worker, seen);
+      });
+    }
+
+    if (threads > 1) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        currentTask = &task;
+        activeWorkers = threads;
+        running = threads - 1;
+        generation++;
+      }
+      wake.notify_all();
+    }
+
+    work(0, task);
+
+    if (threads > 1) {
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [&]() { return running == 0; });
+      currentTask = nullptr;
+    }
+
+    if (error != nullptr) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  /**
+   * Chunks of one worker
+   */
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<size_t> chunks;
+  };
+
+  /**
+   * Helper thread: waits for a run (a new generation) which uses this
+   * worker, works on it, and parks again
+   */
+  void park(size_t worker, size_t seen) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [&]() { return stop || generation != seen; });
+      if (stop) {
+        return;
+      }
+      seen = generation;
+      if (worker >= activeWorkers) {
+        continue;
+      }
+
+      auto task = currentTask;
+      lock.unlock();
+      work(worker, *task);
+      lock.lock();
+
+      if (--running == 0) {
+        done.notify_one();
+      }
+    }
+  }
+
+  /**
+   * Worker loop: own chunks first, then steal
+   */
+  void work(size_t worker, const ChunkTask &task) {
+    size_t chunk;
+    while (take(worker, chunk) || steal(worker, chunk)) {
+      try {
+        task(worker, chunk);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (error == nullptr) {
+          error = std::current_exception();
+        }
+      }
+    }
+  }
+
+  bool take(size_t worker, size_t &chunk) {
+    auto &queue = queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.chunks.empty()) {
+      return false;
+    }
+    chunk = queue.chunks.front();
+    queue.chunks.pop_front();
+    return true;
+  }
+
+  /**
+   * Steals from the back of the next non-empty queue. No chunks are
+   * added while running, so a failed scan means all work is taken.
+   */
+  bool steal(size_t worker, size_t &chunk) {
+    for (size_t i = 1; i < queues.size(); i++) {
+      auto &queue = queues[(worker + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.chunks.empty()) {
+        chunk = queue.chunks.back();
+        queue.chunks.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<WorkQueue> queues;
+
+  /**
+   * Parked helper threads (workers 1..N)
+   */
+  std::vector<std::thread> helpers;
+
+  /**
+   * Current run, guarded by the mutex: a new generation wakes the
+   * helpers, `running` helpers haven't finished it yet
+   */
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const ChunkTask *currentTask = nullptr;
+  size_t activeWorkers = 0;
+  size_t running = 0;
+  size_t generation = 0;
+  bool stop = false;
+
+  std::mutex errorMutex;
+  std::exception_ptr error;
+};
+
+#endif
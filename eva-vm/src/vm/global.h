@@ -5,6 +5,12 @@
 #ifndef GLOBAL_H
 #define GLOBAL_H
 
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
 #include "eva_value.h"
 
 /**
@@ -15,22 +21,85 @@ struct GlobalVar {
   EvaValue value;
 };
 
+/**
+ * Frozen globals and interned strings: built once by EvaVM::freeze,
+ * then shared read-only (without locks) by any number of VMs.
+ * Objects reachable from the table are marked frozen (immutable).
+ */
+struct FrozenTable {
+  std::vector<GlobalVar> globals;
+
+  /**
+   * Global indices by name
+   */
+  std::unordered_map<std::string, size_t> indices;
+
+  /**
+   * Strings reachable from the globals, by contents
+   */
+  std::unordered_map<std::string_view, StringObject *> strings;
+};
+
 /**
  * Global object
+ *
+ * Indices [0, frozen count) are the frozen globals, private globals of
+ * the VM follow. A frozen global is read through a dense per-VM slot,
+ * which points into the frozen table until the first write copies the
+ * global into `overrides`.
  */
 struct Global {
-  GlobalVar &get(size_t index) { return globals[index]; }
+  Global() = default;
+
+  explicit Global(std::shared_ptr<const FrozenTable> frozen) {
+    rebase(frozen);
+  }
+
+  /**
+   * Reads a global
+   */
+  const GlobalVar &get(size_t index) const {
+    if (index >= frozenCount) {
+      return globals[index - frozenCount];
+    }
+    return *frozenSlots[index];
+  }
+
+  /**
+   * Writable global (copies a frozen one on first write)
+   */
+  GlobalVar &getMutable(size_t index) {
+    if (index >= frozenCount) {
+      return globals[index - frozenCount];
+    }
+    auto &slot = frozenSlots[index];
+    if (slot == &frozen->globals[index]) {
+      slot = &overrides.emplace_back(*slot);
+    }
+    // A private copy (owned by `overrides`) by now
+    return const_cast<GlobalVar &>(*slot);
+  }
 
   /**
    * Set a global
    */
   void set(size_t index, const EvaValue &value) {
-    if (index >= globals.size()) {
+    if (index >= size()) {
       DIE << "Global " << index << " doesn't exist";
     }
-    globals[index].value = value;
+    getMutable(index).value = value;
   }
 
+  /**
+   * Number of globals (frozen and private)
+   */
+  size_t size() const { return frozenCount + globals.size(); }
+
+  /**
+   * Number of frozen globals
+   */
+  size_t frozenSize() const { return frozenCount; }
+
   /**
    * Register a global
    */
@@ -43,26 +112,50 @@ struct Global {
     }
 
     // Set to default number 0
-    globals.push_back({name, NUMBER(0)});
+    add(name, INT(0));
+  }
+
+  /**
+   * Drops private globals past the first `count` (those defined by
+   * a form which failed to compile)
+   */
+  void truncate(size_t count) {
+    if (count >= frozenCount && count < size()) {
+      for (auto i = count - frozenCount; i < globals.size(); i++) {
+        indices.erase(globals[i].name);
+      }
+      globals.erase(globals.begin() + (count - frozenCount), globals.end());
+    }
+  }
+
+  /**
+   * Drops all private globals
+   */
+  void clear() {
+    globals.clear();
+    indices.clear();
   }
 
   /**
    * Adds a global constant
    */
-  void addConst(const std::string &name, double value) {
+  void addConst(const std::string &name, const EvaValue &value) {
     if (exists(name))
       return;
 
-    globals.push_back({name, NUMBER(value)});
+    add(name, value);
   }
 
   // Get local index
-  int getGlobalIndex(const std::string &name) {
-    if (globals.size() > 0) {
-      for (auto i = (int)globals.size() - 1; i >= 0; i--) {
-        if (globals[i].name == name) {
-          return i;
-        }
+  int getGlobalIndex(const std::string &name) const {
+    auto it = indices.find(name);
+    if (it != indices.end()) {
+      return it->second;
+    }
+    if (frozen != nullptr) {
+      auto frozenIt = frozen->indices.find(name);
+      if (frozenIt != frozen->indices.end()) {
+        return frozenIt->second;
       }
     }
     return -1;
@@ -71,12 +164,64 @@ struct Global {
   /**
    * Whether a global variable exists
    */
-  bool exists(const std::string &name) { return getGlobalIndex(name) != -1; }
+  bool exists(const std::string &name) const {
+    return getGlobalIndex(name) != -1;
+  }
+
+  /**
+   * Frozen string with the given contents (nullptr if none)
+   */
+  StringObject *frozenString(std::string_view str) const {
+    if (frozen == nullptr) {
+      return nullptr;
+    }
+    auto it = frozen->strings.find(str);
+    return it == frozen->strings.end() ? nullptr : it->second;
+  }
+
+  /**
+   * Makes the frozen table the base of the globals. Indices are kept,
+   * as long as the table was built from these globals.
+   */
+  void rebase(std::shared_ptr<const FrozenTable> table) {
+    frozen = table;
+    frozenCount = table->globals.size();
+    clear();
+    overrides.clear();
+    frozenSlots.resize(frozenCount);
+    for (size_t i = 0; i < frozenCount; i++) {
+      frozenSlots[i] = &table->globals[i];
+    }
+  }
+
+private:
+  /**
+   * Appends a private global
+   */
+  void add(const std::string &name, const EvaValue &value) {
+    indices.emplace(name, size());
+    globals.push_back({name, value});
+  }
 
   /**
-   * Global variables and functions
+   * Private global variables and functions (after the frozen ones),
+   * and their indices by name
    */
   std::vector<GlobalVar> globals;
+  std::unordered_map<std::string, size_t> indices;
+
+  std::shared_ptr<const FrozenTable> frozen;
+  size_t frozenCount = 0;
+
+  /**
+   * Frozen globals by index: in the table, or the private copy
+   */
+  std::vector<const GlobalVar *> frozenSlots;
+
+  /**
+   * Private copies of written frozen globals (stable addresses)
+   */
+  std::deque<GlobalVar> overrides;
 };
 
 #endif
@@ -7,17 +7,98 @@
 
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
+#include <string>
 
-class ErrorLogMessage : public std::basic_ostringstream<char> {
+/**
+ * Error kinds
+ */
+enum class EvaErrorKind {
+  SYNTAX,
+  COMPILE,
+  RUNTIME,
+  HEAP_LIMIT,
+  BUDGET,
+};
+
+/**
+ * Recoverable error of a script, with the source position
+ * (line:column of the top-level form, 0 if unknown)
+ */
+struct EvaError : public std::runtime_error {
+  EvaError(const std::string &message,
+           EvaErrorKind kind = EvaErrorKind::RUNTIME, int line = 0,
+           int column = 0)
+      : std::runtime_error(message), kind(kind), line(line), column(column) {}
+
+  EvaErrorKind kind;
+  int line;
+  int column;
+};
+
+/**
+ * Collects the error message of DIE, which throws it as EvaError at
+ * the end of the statement. The VM API catches it, so an error aborts
+ * the script, not the process.
+ */
+class ErrorLogMessage {
 public:
-  ~ErrorLogMessage() {
-    fprintf(stderr, "Fatal error: %s\n", str().c_str());
-    exit(EXIT_FAILURE);
+  /**
+   * Throws the collected message
+   */
+  [[noreturn]] void raise() { throw EvaError(stream.str()); }
+
+  template <typename T> ErrorLogMessage &operator<<(const T &value) {
+    stream << value;
+    return *this;
   }
+
+  ErrorLogMessage &operator<<(std::ios_base &(*manipulator)(std::ios_base &)) {
+    stream << manipulator;
+    return *this;
+  }
+
+private:
+  std::ostringstream stream;
 };
 
-#define DIE ErrorLogMessage()
+/**
+ * DIE << "message": the loop body collects the message, and its step
+ * throws (a throwing destructor would terminate the process when an
+ * error is raised while the message is built)
+ */
+#define DIE for (ErrorLogMessage dieMessage;; dieMessage.raise()) dieMessage
 
 #define log(value) (std::cout << #value << " = " << value << '\n')
 
+/**
+ * Error kind name
+ */
+std::string evaErrorKindToString(EvaErrorKind kind) {
+  switch (kind) {
+  case EvaErrorKind::SYNTAX:
+    return "Syntax error";
+  case EvaErrorKind::COMPILE:
+    return "Compile error";
+  case EvaErrorKind::RUNTIME:
+    return "Runtime error";
+  case EvaErrorKind::HEAP_LIMIT:
+    return "Heap limit error";
+  case EvaErrorKind::BUDGET:
+    return "Budget exceeded";
+  }
+  return "Error";
+}
+
+/**
+ * Output stream: "<kind> at line:column: message"
+ */
+std::ostream &operator<<(std::ostream &os, const EvaError &error) {
+  os << evaErrorKindToString(error.kind);
+  if (error.line != 0) {
+    os << " at " << error.line << ":" << error.column;
+  }
+  return os << ": " << error.what();
+}
+
 #endif
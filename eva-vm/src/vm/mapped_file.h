@@ -0,0 +1,75 @@
+/**
+ * Read-only memory-mapped file
+ */
+
+#ifndef MAPPED_FILE__H
+#define MAPPED_FILE__H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "logger.h"
+
+/**
+ * Maps a whole file read-only, the contents are a view of the mapping
+ * (valid while the object lives)
+ */
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      DIE << "Can't open " << path << ": " << strerror(errno);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      auto error = errno;
+      close(fd);
+      DIE << "Can't stat " << path << ": " << strerror(error);
+    }
+
+    size = st.st_size;
+
+    // Empty files can't be mapped
+    if (size != 0) {
+      data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        auto error = errno;
+        close(fd);
+        DIE << "Can't map " << path << ": " << strerror(error);
+      }
+      madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    // The mapping stays valid after close
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (size != 0) {
+      munmap(data, size);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  /**
+   * File contents
+   */
+  std::string_view view() const { return {(const char *)data, size}; }
+
+private:
+  void *data = nullptr;
+  size_t size = 0;
+};
+
+#endif